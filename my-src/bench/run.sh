@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+#   Time every bench/*.lspy with both engines, best of three runs
+#
+#   bench/run.sh ./main
+#   bench/run.sh ./main /path/to/baseline/main
+#
+#   With a second interpreter each script is also timed with it, so a change
+#   can be compared against a build from before it.
+#
+
+dir=$(dirname "$0")
+main=${1:-./main}
+baseline=$2
+
+# Best wall clock time in seconds of three runs of the given command
+best() {
+    best_time=
+    for run in 1 2 3; do
+        start=$(date +%s.%N)
+        "$@" > /dev/null 2>&1 || { echo "failed: $*" >&2; exit 1; }
+        end=$(date +%s.%N)
+        best_time=$(echo "$start $end $best_time" | awk '{ t = $2 - $1; if ($3 != "" && $3 < t) t = $3; printf "%.3f", t }')
+    done
+    echo "$best_time"
+}
+
+printf "%-20s %-8s %10s %10s\n" "script" "engine" "seconds" "baseline"
+for script in "$dir"/*.lspy; do
+    for engine in vm tree; do
+        new=$(best "$main" --engine=$engine "$script") || exit 1
+        old=-
+        if [ -n "$baseline" ]; then
+            old=$(best "$baseline" --engine=$engine "$script") || exit 1
+        fi
+        printf "%-20s %-8s %10s %10s\n" "$(basename "$script")" "$engine" "$new" "$old"
+    done
+done
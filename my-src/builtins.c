@@ -4,6 +4,8 @@
 #include "lenv.h"
 #include "main.h"
 #include "parsing.h"
+#include "image.h"
+#include "vm.h"
 
 #define LASSERT(args, cond, fmt, ...) \
     if (!(cond)) { \
@@ -31,9 +33,11 @@ lval *builtin_head(lenv *e, lval *a) {
     LASSERT_TYPE("head", a, 0, LVAL_QEXPR)
     LASSERT_NOT_EMPTY("head", a, 0)
 
+    // build a new list sharing the first element rather than trimming the old one
     lval *v = lval_take(a, 0);
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
+    lval *x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+    lval_del(v);
+    return x;
 }
 
 lval *builtin_tail(lenv *e, lval *a) {
@@ -41,7 +45,7 @@ lval *builtin_tail(lenv *e, lval *a) {
     LASSERT_TYPE("tail", a, 0, LVAL_QEXPR)
     LASSERT_NOT_EMPTY("tail", a, 0)
 
-    lval *v = lval_take(a, 0);
+    lval *v = lval_own(lval_take(a, 0));
     lval_del(lval_pop(v, 0));
     return v;
 }
@@ -52,12 +56,17 @@ lval *builtin_list(lenv *e, lval *a) {
 }
 
 lval *builtin_eval(lenv *e, lval *a) {
+    return lval_eval(e, builtin_eval_expr(e, a));
+}
+
+/* Check the arguments to 'eval' and return the expression to evaluate */
+lval *builtin_eval_expr(lenv *e, lval *a) {
     LASSERT_NUM("eval", a, 1)
     LASSERT_TYPE("eval", a, 0, LVAL_QEXPR)
 
-    lval *x = lval_take(a, 0);
+    lval *x = lval_own(lval_take(a, 0));
     x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    return x;
 }
 
 lval *builtin_join(lenv *e, lval *a) {
@@ -74,58 +83,139 @@ lval *builtin_join(lenv *e, lval *a) {
     return x;
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
+static char *lop_names[] = {"+", "-", "*", "/", ">", "<", ">=", "<=", "==", "!="};
+
+/* Fold an arithmetic operator over its arguments */
+lval *builtin_op(lenv *e, lval *a, int op) {
+    char *name = lop_names[op];
+    LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", name)
+
     /* Ensure all elements are numbers */
     for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM)
+        LASSERT_TYPE(name, a, i, LVAL_NUM)
     }
 
-    /* Pop the first element */
-    lval *x = lval_pop(a, 0);
+    long x = a->cell[0]->num;
 
     /* If no arguments and sub then perform unary operation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+    if (op == LOP_SUB && a->count == 1) {
+        x = -x;
+    }
+
+    for (int i = 1; i < a->count; i++) {
+        long y = a->cell[i]->num;
+        switch (op) {
+            case LOP_ADD:
+                x += y;
+                break;
+            case LOP_SUB:
+                x -= y;
+                break;
+            case LOP_MUL:
+                x *= y;
+                break;
+            case LOP_DIV:
+                if (y == 0) {
+                    lval_del(a);
+                    return lval_err("Division by zero!");
+                }
+                x /= y;
+                break;
+        }
     }
 
-    /* While there are still elements remaining */
-    while (a->count > 0) {
-        /* Pop the next element */
-        lval *y = lval_pop(a, 0);
+    /* The first argument holds the result if nothing else refers to it */
+    lval *r = lval_own(lval_take(a, 0));
+    r->num = x;
+    return r;
+}
 
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
+/* Operator implemented by builtin 'f', or -1 if it isn't one of them */
+int builtin_lop(lbuiltin f) {
+    static const lbuiltin builtins[] = {
+        builtin_add, builtin_sub, builtin_mul, builtin_div,
+        builtin_gt, builtin_lt, builtin_ge, builtin_le,
+        builtin_eq, builtin_ne
+    };
+    for (int op = 0; op < (int) (sizeof(builtins) / sizeof(builtins[0])); op++) {
+        if (builtins[op] == f) { return op; }
+    }
+    return -1;
+}
+
+/* Apply operator 'op' to the numbers x and y without building an argument list, consuming both */
+lval *builtin_num_op(int op, lval *x, lval *y) {
+    long a = x->num;
+    long b = y->num;
+    lval_del(y);
+
+    long r = 0;
+    switch (op) {
+        case LOP_ADD:
+            r = a + b;
+            break;
+        case LOP_SUB:
+            r = a - b;
+            break;
+        case LOP_MUL:
+            r = a * b;
+            break;
+        case LOP_DIV:
+            if (b == 0) {
                 lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero!");
-                break;
+                return lval_err("Division by zero!");
             }
-            x->num /= y->num;
-        }
-        lval_del(y);
+            r = a / b;
+            break;
+        case LOP_GT:
+            r = a > b;
+            break;
+        case LOP_LT:
+            r = a < b;
+            break;
+        case LOP_GE:
+            r = a >= b;
+            break;
+        case LOP_LE:
+            r = a <= b;
+            break;
+        case LOP_EQ:
+            r = a == b;
+            break;
+        case LOP_NE:
+            r = a != b;
+            break;
     }
 
-    lval_del(a);
+    x = lval_own(x);
+    x->num = r;
     return x;
 }
 
 lval *builtin_add(lenv *e, lval *a) {
-    return builtin_op(e, a, "+");
+    return builtin_op(e, a, LOP_ADD);
 }
 
 lval *builtin_sub(lenv *e, lval *a) {
-    return builtin_op(e, a, "-");
+    return builtin_op(e, a, LOP_SUB);
 }
 
 lval *builtin_mul(lenv *e, lval *a) {
-    return builtin_op(e, a, "*");
+    return builtin_op(e, a, LOP_MUL);
 }
 
 lval *builtin_div(lenv *e, lval *a) {
-    return builtin_op(e, a, "/");
+    return builtin_op(e, a, LOP_DIV);
+}
+
+/* Bind for 'def' if global is set, otherwise for '=' */
+static void builtin_bind(lenv *e, int global, lval *sym, lval *val) {
+    if (global) {
+        lenv_def(e, sym, val);
+        return;
+    }
+    if (e->parent) { sym->sym->local = 1; }
+    lenv_put(e, sym, val);
 }
 
 lval *builtin_var(lenv *e, lval *a, char *func) {
@@ -142,100 +232,73 @@ lval *builtin_var(lenv *e, lval *a, char *func) {
             "Function '%s' cannot take incorrect number of values to symbols. Got %s, expected %s",
             func, syms->count, a->count - 1)
 
+    int global = strcmp(func, "def") == 0;
     for (int i = 0; i < syms->count; i++) {
-        // If 'def' define it globally, else define locally
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
-        }
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
-        }
+        builtin_bind(e, global, syms->cell[i], a->cell[i + 1]);
     }
     lval_del(a);
     return lval_sexpr();
 }
 
-lval *builtin_ord(lenv *e, lval *a, char *op) {
+lval *builtin_ord(lenv *e, lval *a, int op) {
     // check that there are two arguments and they're both numbers
-    LASSERT_NUM(op, a, 2)
-    LASSERT_TYPE(op, a, 0, LVAL_NUM)
-    LASSERT_TYPE(op, a, 1, LVAL_NUM)
-
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = a->cell[0]->num > a->cell[1]->num;
-    } else if (strcmp(op, "<") == 0) {
-        r = a->cell[0]->num < a->cell[1]->num;
-    } else if (strcmp(op, ">=") == 0) {
-        r = a->cell[0]->num >= a->cell[1]->num;
-    } else if (strcmp(op, "<=") == 0) {
-        r = a->cell[0]->num <= a->cell[1]->num;
-    } else {
-        // should never happen
-        return lval_err("'%s' is not a known ordering", op);
-    }
+    LASSERT_NUM(lop_names[op], a, 2)
+    LASSERT_TYPE(lop_names[op], a, 0, LVAL_NUM)
+    LASSERT_TYPE(lop_names[op], a, 1, LVAL_NUM)
 
+    lval *x = lval_pop(a, 0);
+    lval *y = lval_pop(a, 0);
     lval_del(a);
-    return lval_num(r);
+    return builtin_num_op(op, x, y);
 }
 
 lval *builtin_gt(lenv *e, lval *a) {
-    return builtin_ord(e, a, ">");
+    return builtin_ord(e, a, LOP_GT);
 }
 
 lval *builtin_lt(lenv *e, lval *a) {
-    return builtin_ord(e, a, "<");
+    return builtin_ord(e, a, LOP_LT);
 }
 
 lval *builtin_ge(lenv *e, lval *a) {
-    return builtin_ord(e, a, ">=");
+    return builtin_ord(e, a, LOP_GE);
 }
 
 lval *builtin_le(lenv *e, lval *a) {
-    return builtin_ord(e, a, "<=");
-}
-
-lval *builtin_cmp(lenv *e, lval *a, char *op) {
-    LASSERT_NUM(op, a, 2)
-    int r;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    } else if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    } else {
-        // shouldn't happen
-        return lval_err("'%s' is unknown comparison.", op);
-    }
+    return builtin_ord(e, a, LOP_LE);
+}
+
+lval *builtin_cmp(lenv *e, lval *a, int op) {
+    LASSERT_NUM(lop_names[op], a, 2)
+    int r = lval_eq(a->cell[0], a->cell[1]);
     lval_del(a);
-    return lval_num(r);
+    return lval_num(op == LOP_EQ ? r : !r);
 }
 
 lval *builtin_eq(lenv *e, lval *a) {
-    return builtin_cmp(e, a, "==");
+    return builtin_cmp(e, a, LOP_EQ);
 }
 
 lval *builtin_ne(lenv *e, lval *a) {
-    return builtin_cmp(e, a, "!=");
+    return builtin_cmp(e, a, LOP_NE);
 }
 
 lval *builtin_if(lenv *e, lval *a) {
+    return lval_eval(e, builtin_if_branch(e, a));
+}
+
+/* Check the arguments to 'if' and return the branch to evaluate */
+lval *builtin_if_branch(lenv *e, lval *a) {
     LASSERT_NUM("if", a, 3)
     LASSERT_TYPE("if", a, 0, LVAL_NUM)
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR)
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR)
 
-    // mark both expressions as evaluable
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
-
-    lval *result;
-    if (a->cell[0]->num) {
-        result = lval_eval(e, lval_pop(a, 1));
-    } else {
-        result = lval_eval(e, lval_pop(a, 2));
-    }
+    // take the chosen expression and mark it as evaluable
+    lval *x = lval_own(lval_pop(a, a->cell[0]->num ? 1 : 2));
+    x->type = LVAL_SEXPR;
     lval_del(a);
-    return result;
+    return x;
 }
 
 lval *builtin_def(lenv *e, lval *a) {
@@ -265,61 +328,171 @@ lval *builtin_lambda(lenv *e, lval *a) {
     lval *body = lval_pop(a, 0);
     lval_del(a);
 
-    return lval_lambda(formals, body);
+    return builtin_lambda_make(e, formals, body);
+}
+
+/* Function from checked formals and body, consuming both */
+lval *builtin_lambda_make(lenv *e, lval *formals, lval *body) {
+    /* Compile the body, resolving its symbols against the frames it is created in */
+    lval *f = lval_lambda(formals, body);
+    if (lispy_engine == ENGINE_VM) {
+        f->code = vm_compile(e, formals, body);
+    }
+    return f;
+}
+
+/* Whether v is a Q-expression of exactly n symbols */
+static int builtin_syms(lval *v, int n) {
+    if (v->type != LVAL_QEXPR || v->count != n) { return 0; }
+    for (int i = 0; i < n; i++) {
+        if (v->cell[i]->type != LVAL_SYM) { return 0; }
+    }
+    return 1;
+}
+
+/*
+ * Evaluate the special forms 'if', 'def', '=' and '\' straight from the
+ * unevaluated expression 'v', whose head evaluated to builtin 'f'. Returns
+ * NULL, consuming nothing, when the arguments aren't literal enough and the
+ * normal call has to be made. Otherwise consumes both and returns the result,
+ * or for 'if' sets *tail and returns the branch still to be evaluated.
+ */
+lval *builtin_form(lenv *e, lval *f, lval *v, int *tail) {
+    lbuiltin b = f->builtin;
+
+    if (b == builtin_if && v->count == 4 && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+        lval *cond = lval_eval(e, lval_copy(v->cell[1]));
+        lval *x;
+        if (cond->type == LVAL_NUM) {
+            x = lval_own(lval_copy(v->cell[cond->num ? 2 : 3]));
+            x->type = LVAL_SEXPR;
+            lval_del(cond);
+        } else if (cond->type == LVAL_ERR) {
+            x = cond;
+        } else {
+            // let the normal path report the bad condition
+            lval *a = lval_add(lval_sexpr(), cond);
+            a = lval_add(a, lval_copy(v->cell[2]));
+            x = builtin_if_branch(e, lval_add(a, lval_copy(v->cell[3])));
+        }
+        lval_del(f);
+        lval_del(v);
+        *tail = 1;
+        return x;
+    }
+
+    if ((b == builtin_def || b == builtin_put) && v->count == 3 && builtin_syms(v->cell[1], 1)) {
+        lval *x = lval_eval(e, lval_copy(v->cell[2]));
+        if (x->type != LVAL_ERR) {
+            builtin_bind(e, b == builtin_def, v->cell[1]->cell[0], x);
+            lval_del(x);
+            x = lval_sexpr();
+        }
+        lval_del(f);
+        lval_del(v);
+        return x;
+    }
+
+    if (b == builtin_lambda && v->count == 3 && v->cell[2]->type == LVAL_QEXPR
+        && builtin_syms(v->cell[1], v->cell[1]->count)) {
+        lval *x = builtin_lambda_make(e, lval_copy(v->cell[1]), lval_copy(v->cell[2]));
+        lval_del(f);
+        lval_del(v);
+        return x;
+    }
+
+    return NULL;
+}
+
+/*
+ * Call builtin 'f' with the evaluated arguments x and y without building an
+ * argument list, for arithmetic and comparison on numbers and the special
+ * forms 'def', '=' and '\'. Returns NULL, consuming nothing, when the normal
+ * call has to be made, otherwise consumes all three and returns the result.
+ */
+lval *builtin_call2(lenv *e, lval *f, lval *x, lval *y) {
+    lbuiltin b = f->builtin;
+
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+        int op = builtin_lop(b);
+        if (op < 0) { return NULL; }
+        lval_del(f);
+        return builtin_num_op(op, x, y);
+    }
+
+    if ((b == builtin_def || b == builtin_put) && builtin_syms(x, 1) && y->type != LVAL_ERR) {
+        builtin_bind(e, b == builtin_def, x->cell[0], y);
+        lval_del(f);
+        lval_del(x);
+        lval_del(y);
+        return lval_sexpr();
+    }
+
+    if (b == builtin_lambda && y->type == LVAL_QEXPR && builtin_syms(x, x->count)) {
+        lval_del(f);
+        return builtin_lambda_make(e, x, y);
+    }
+
+    return NULL;
 }
 
 lval *builtin_load(lenv *e, lval *a) {
     LASSERT_NUM("load", a, 1)
     LASSERT_TYPE("load", a, 0, LVAL_STR)
 
-    // parse file given by string name
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        // read contents
-        lval *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        // evaluate each expression
-        while (expr->count) {
-            lval *x = lval_eval(e, lval_pop(expr, 0));
-            // if evaluation leads to an error print it
-            if (x->type == LVAL_ERR) { lval_println(x); }
+    // read and evaluate one form at a time so results appear as the file is read
+    lreader r;
+    lreader_open(&r, a->cell[0]->str);
+    lval *x;
+    while ((x = lreader_next(&r))) {
+        if (x->type == LVAL_ERR) {
+            // the reader failed, stop loading
+            lval *err = lval_err("Could not load Library %s", x->err);
             lval_del(x);
+            lreader_close(&r);
+            lval_del(a);
+            return err;
         }
 
-        // delete expressions and arguments
-        lval_del(expr);
-        lval_del(a);
-
-        // return empty list
-        return lval_sexpr();
-    } else {
-        // get parse error as string
-        char *error_message = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-
-        // create new error message using it
-        lval *err = lval_err("Could not load Library %s", error_message);
-        free(error_message);
-        lval_del(a);
-        return err;
+        x = lval_eval(e, x);
+        // if evaluation leads to an error print it
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
     }
+
+    lreader_close(&r);
+    lval_del(a);
+    return lval_sexpr();
 }
 
 lval *builtin_print(lenv *e, lval *a) {
     // print each argument followed by a space
+    lval_stdout.out = stdout;
     for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]);
-        putchar(' ');
+        lval_write(&lval_stdout, a->cell[i]);
+        lbuf_char(&lval_stdout, ' ');
     }
 
-    // print newline and delete arguments
-    putchar('\n');
+    // print newline, write the line out in one go and delete arguments
+    lbuf_char(&lval_stdout, '\n');
+    lbuf_flush(&lval_stdout);
     lval_del(a);
 
     return lval_sexpr();
 }
 
+lval *builtin_show(lenv *e, lval *a) {
+    LASSERT_NUM("show", a, 1)
+
+    // print the argument into a string instead of to stdout
+    lbuf b = {NULL, 0, 0, NULL};
+    lval_write(&b, a->cell[0]);
+    lval *x = lval_str_len(b.data, b.len);
+    free(b.data);
+    lval_del(a);
+    return x;
+}
+
 lval *builtin_error(lenv *e, lval *a) {
     LASSERT_NUM("error", a, 1)
     LASSERT_TYPE("error", a, 0, LVAL_STR)
@@ -331,3 +504,23 @@ lval *builtin_error(lenv *e, lval *a) {
     lval_del(a);
     return err;
 }
+
+lval *builtin_save(lenv *e, lval *a) {
+    LASSERT_NUM("save", a, 2)
+    LASSERT_TYPE("save", a, 0, LVAL_STR)
+
+    // write the value in binary to the file named by the first argument
+    lval *x = image_save_value(a->cell[1], a->cell[0]->str);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_restore(lenv *e, lval *a) {
+    LASSERT_NUM("restore", a, 1)
+    LASSERT_TYPE("restore", a, 0, LVAL_STR)
+
+    // read back a value written by save
+    lval *x = image_load_value(e, a->cell[0]->str);
+    lval_del(a);
+    return x;
+}
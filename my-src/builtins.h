@@ -4,11 +4,27 @@
 // Forward declarations
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+/* Arithmetic and comparison operators on numbers */
+enum {
+    LOP_ADD,
+    LOP_SUB,
+    LOP_MUL,
+    LOP_DIV,
+    LOP_GT,
+    LOP_LT,
+    LOP_GE,
+    LOP_LE,
+    LOP_EQ,
+    LOP_NE
+};
+
 lval *builtin_list(lenv *e, lval *a);
 
 lval *builtin_head(lenv *e, lval *a);
@@ -17,9 +33,15 @@ lval *builtin_tail(lenv *e, lval *a);
 
 lval *builtin_eval(lenv *e, lval *a);
 
+lval *builtin_eval_expr(lenv *e, lval *a);
+
 lval *builtin_join(lenv *e, lval *a);
 
-lval *builtin_op(lenv *e, lval *a, char *op);
+lval *builtin_op(lenv *e, lval *a, int op);
+
+int builtin_lop(lbuiltin f);
+
+lval *builtin_num_op(int op, lval *x, lval *y);
 
 lval *builtin_add(lenv *e, lval *a);
 
@@ -43,16 +65,30 @@ lval *builtin_ne(lenv *e, lval *a);
 
 lval *builtin_if(lenv *e, lval *a);
 
+lval *builtin_if_branch(lenv *e, lval *a);
+
 lval *builtin_def(lenv *e, lval *a);
 
 lval *builtin_put(lenv *e, lval *a);
 
 lval *builtin_lambda(lenv *e, lval *a);
 
+lval *builtin_lambda_make(lenv *e, lval *formals, lval *body);
+
+lval *builtin_form(lenv *e, lval *f, lval *v, int *tail);
+
+lval *builtin_call2(lenv *e, lval *f, lval *x, lval *y);
+
 lval *builtin_load(lenv *e, lval *a);
 
 lval *builtin_print(lenv *e, lval *a);
 
+lval *builtin_show(lenv *e, lval *a);
+
 lval *builtin_error(lenv *e, lval *a);
 
+lval *builtin_save(lenv *e, lval *a);
+
+lval *builtin_restore(lenv *e, lval *a);
+
 #endif
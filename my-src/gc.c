@@ -0,0 +1,258 @@
+#ifdef LISPY_GC
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "lval.h"
+#include "lenv.h"
+#include "slab.h"
+#include "vm.h"
+
+/* Every managed object is preceded by a header linking it into the heap */
+typedef struct gc_header {
+    struct gc_header *next;
+    int kind;
+    int marked;
+    size_t size;
+} gc_header;
+
+#define GC_OBJECT(h) ((void *) ((h) + 1))
+#define GC_HEADER(p) ((gc_header *) (p) - 1)
+
+/* Collect once this many objects have been allocated since the last collection */
+#define GC_MIN_THRESHOLD 100000
+
+static gc_header *heap = NULL;
+static int heap_count = 0;
+static int allocated = 0;
+static int threshold = GC_MIN_THRESHOLD;
+
+static void *stack_base = NULL;
+
+static lenv **roots = NULL;
+static int roots_count = 0;
+
+/* Growable arrays of values owned outside the heap, such as the VM stack */
+typedef struct gc_cells {
+    lval ***cells;
+    int *count;
+} gc_cells;
+
+static gc_cells *cell_roots = NULL;
+static int cell_roots_count = 0;
+
+/* Open addressing set of object addresses, used to recognise pointers on the stack */
+static void **objects = NULL;
+static int objects_size = 0;
+
+/* Objects marked but not yet scanned */
+static gc_header **gray = NULL;
+static int gray_count = 0;
+static int gray_capacity = 0;
+
+static int gc_slot(void *p) {
+    uintptr_t h = (uintptr_t) p;
+    h ^= h >> 17;
+    h *= 0xed5ad4bbu;
+    return (int) (h & (objects_size - 1));
+}
+
+static void gc_objects_insert(void *p) {
+    int slot = gc_slot(p);
+    while (objects[slot]) { slot = (slot + 1) & (objects_size - 1); }
+    objects[slot] = p;
+}
+
+static int gc_objects_contains(void *p) {
+    if (!objects) { return 0; }
+    for (int slot = gc_slot(p); objects[slot]; slot = (slot + 1) & (objects_size - 1)) {
+        if (objects[slot] == p) { return 1; }
+    }
+    return 0;
+}
+
+/* Rebuild the object set so it is at most half full */
+static void gc_objects_rebuild() {
+    free(objects);
+    objects_size = 1024;
+    while (objects_size < heap_count * 2) { objects_size *= 2; }
+    objects = calloc(objects_size, sizeof(void *));
+    for (gc_header *h = heap; h; h = h->next) {
+        gc_objects_insert(GC_OBJECT(h));
+    }
+}
+
+void gc_init(void *base) {
+    stack_base = base;
+}
+
+void gc_root(lenv *e) {
+    roots = realloc(roots, sizeof(lenv *) * (roots_count + 1));
+    roots[roots_count++] = e;
+}
+
+void gc_root_cells(lval ***cells, int *count) {
+    cell_roots = realloc(cell_roots, sizeof(gc_cells) * (cell_roots_count + 1));
+    cell_roots[cell_roots_count++] = (gc_cells) {cells, count};
+}
+
+void *gc_alloc(int kind, size_t size) {
+    if (allocated >= threshold) { gc_collect(); }
+
+    gc_header *h = slab_alloc(sizeof(gc_header) + size);
+    memset(h, 0, sizeof(gc_header) + size);
+    h->kind = kind;
+    h->size = size;
+    h->next = heap;
+    heap = h;
+    heap_count++;
+    allocated++;
+
+    if (heap_count * 2 > objects_size) {
+        gc_objects_rebuild();
+    } else {
+        gc_objects_insert(GC_OBJECT(h));
+    }
+    return GC_OBJECT(h);
+}
+
+static void gc_mark(void *p) {
+    if (!p) { return; }
+    gc_header *h = GC_HEADER(p);
+    if (h->marked) { return; }
+    h->marked = 1;
+
+    if (gray_count == gray_capacity) {
+        gray_capacity = gray_capacity ? gray_capacity * 2 : 256;
+        gray = realloc(gray, sizeof(gc_header *) * gray_capacity);
+    }
+    gray[gray_count++] = h;
+}
+
+/* Mark everything reachable from the gray objects */
+static void gc_trace() {
+    while (gray_count) {
+        gc_header *h = gray[--gray_count];
+        if (h->kind == GC_LENV) {
+            lenv *e = GC_OBJECT(h);
+            gc_mark(e->parent);
+            if (e->code) { gc_mark(e->code->body); }
+            for (int i = 0; i < e->count; i++) { gc_mark(e->vals[i]); }
+            continue;
+        }
+
+        lval *v = GC_OBJECT(h);
+        switch (v->type) {
+            case LVAL_FUN:
+                if (!v->builtin) {
+                    gc_mark(v->env);
+                    gc_mark(v->formals);
+                    gc_mark(v->body);
+                }
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                for (int i = 0; i < v->count; i++) { gc_mark(v->cell[i]); }
+                break;
+        }
+    }
+}
+
+/* Treat every aligned word between here and the stack base as a possible pointer */
+static void __attribute__((noinline, no_sanitize_address)) gc_scan_stack() {
+    void *here = &here;
+    char *lo = (char *) here < (char *) stack_base ? (char *) here : (char *) stack_base;
+    char *hi = (char *) here < (char *) stack_base ? (char *) stack_base : (char *) here;
+    for (char *p = lo; p + sizeof(void *) <= hi; p += sizeof(void *)) {
+        void *x = *(void **) p;
+        if (gc_objects_contains(x)) { gc_mark(x); }
+    }
+}
+
+/* Release the memory owned by an object, the objects it refers to are left alone */
+static void gc_free(gc_header *h) {
+    if (h->kind == GC_LENV) {
+        lenv *e = GC_OBJECT(h);
+        free(e->syms);
+        free(e->vals);
+        free(e->index);
+        if (e->code) { lcode_del(e->code); }
+    } else {
+        lval *v = GC_OBJECT(h);
+        switch (v->type) {
+            case LVAL_ERR:
+                free(v->err);
+                break;
+            case LVAL_STR:
+                free(v->str);
+                break;
+            case LVAL_FUN:
+                if (!v->builtin && v->code) { lcode_del(v->code); }
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                slab_free(v->cell - v->offset, sizeof(lval *) * v->capacity);
+                break;
+        }
+    }
+    slab_free(h, sizeof(gc_header) + h->size);
+}
+
+static void gc_sweep() {
+    gc_header **link = &heap;
+    while (*link) {
+        gc_header *h = *link;
+        if (h->marked) {
+            h->marked = 0;
+            link = &h->next;
+        } else {
+            *link = h->next;
+            gc_free(h);
+            heap_count--;
+        }
+    }
+}
+
+void gc_collect() {
+    /* Spill callee saved registers onto the stack so the scan sees them */
+    __builtin_unwind_init();
+
+    for (int i = 0; i < roots_count; i++) { gc_mark(roots[i]); }
+    for (int i = 0; i < cell_roots_count; i++) {
+        gc_cells r = cell_roots[i];
+        for (int j = 0; j < *r.count; j++) { gc_mark((*r.cells)[j]); }
+    }
+    if (stack_base) { gc_scan_stack(); }
+    gc_trace();
+    gc_sweep();
+    gc_objects_rebuild();
+
+    allocated = 0;
+    threshold = heap_count > GC_MIN_THRESHOLD ? heap_count : GC_MIN_THRESHOLD;
+}
+
+void gc_cleanup() {
+    while (heap) {
+        gc_header *h = heap;
+        heap = h->next;
+        gc_free(h);
+    }
+    heap_count = 0;
+    free(objects);
+    objects = NULL;
+    objects_size = 0;
+    free(roots);
+    roots = NULL;
+    roots_count = 0;
+    free(cell_roots);
+    cell_roots = NULL;
+    cell_roots_count = 0;
+    free(gray);
+    gray = NULL;
+    gray_count = 0;
+    gray_capacity = 0;
+}
+
+#endif
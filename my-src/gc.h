@@ -0,0 +1,35 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+#include "builtins.h"
+
+/*
+ * Optional tracing mark and sweep collector, enabled by building with LISPY_GC.
+ *
+ * lval and lenv objects are allocated from a managed heap. The roots are the
+ * registered environments and value arrays plus a conservative scan of the C
+ * stack between the current frame and the base recorded by gc_init, so the
+ * evaluator does not need to register its temporaries. Only pointers to the
+ * start of an object keep it alive.
+ */
+
+enum {
+    GC_LVAL,
+    GC_LENV
+};
+
+void gc_init(void *stack_base);
+
+void gc_root(lenv *e);
+
+void gc_root_cells(lval ***cells, int *count);
+
+void *gc_alloc(int kind, size_t size);
+
+void gc_collect();
+
+void gc_cleanup();
+
+#endif
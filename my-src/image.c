@@ -0,0 +1,477 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "builtins.h"
+#include "lsym.h"
+
+#define IMAGE_MAGIC "LSPYIMG1"
+#define IMAGE_DATA_MAGIC "LSPYDAT1"
+#define IMAGE_MAGIC_LEN 8
+
+/* Deepest nesting of lists and lambdas written or read, values recurse once per level */
+#define IMAGE_MAX_DEPTH 10000
+
+/* Value tags, atoms and lists are tagged with their LVAL_ type */
+enum {
+    IMAGE_BUILTIN = 16,
+    IMAGE_LAMBDA
+};
+
+/* Growable output buffer */
+typedef struct ibuf {
+    char *data;
+    size_t len;
+    size_t capacity;
+} ibuf;
+
+static void ibuf_reserve(ibuf *b, size_t n) {
+    if (b->len + n <= b->capacity) { return; }
+    while (b->len + n > b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 4096;
+    }
+    b->data = realloc(b->data, b->capacity);
+}
+
+static void ibuf_byte(ibuf *b, unsigned char c) {
+    ibuf_reserve(b, 1);
+    b->data[b->len++] = (char) c;
+}
+
+static void ibuf_bytes(ibuf *b, char *s, size_t n) {
+    ibuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+/* Unsigned LEB128, seven bits at a time with the top bit set on all but the last byte */
+static void ibuf_varint(ibuf *b, unsigned long x) {
+    ibuf_reserve(b, 10);
+    while (x >= 0x80) {
+        b->data[b->len++] = (char) (x | 0x80);
+        x >>= 7;
+    }
+    b->data[b->len++] = (char) x;
+}
+
+static void ibuf_string(ibuf *b, char *s, size_t n) {
+    ibuf_varint(b, n);
+    ibuf_bytes(b, s, n);
+}
+
+/* Writer state, symbols are numbered in the order they are first written */
+typedef struct iwriter {
+    ibuf values;
+    lsym **syms;
+    int syms_count;
+
+    // Open addressing index into syms, each slot holds position + 1 (0 is empty)
+    int *index;
+    int index_size;
+
+    // Nesting of the value being written, too_deep is set past IMAGE_MAX_DEPTH
+    int depth;
+    int too_deep;
+} iwriter;
+
+static int iwriter_sym(iwriter *w, lsym *sym) {
+    if ((w->syms_count + 1) * 2 > w->index_size) {
+        free(w->index);
+        w->index_size = w->index_size ? w->index_size * 2 : 256;
+        w->index = calloc(w->index_size, sizeof(int));
+        for (int i = 0; i < w->syms_count; i++) {
+            int slot = (int) (w->syms[i]->hash & (w->index_size - 1));
+            while (w->index[slot]) { slot = (slot + 1) & (w->index_size - 1); }
+            w->index[slot] = i + 1;
+        }
+        w->syms = realloc(w->syms, sizeof(lsym *) * w->index_size / 2);
+    }
+
+    int slot = (int) (sym->hash & (w->index_size - 1));
+    while (w->index[slot]) {
+        if (w->syms[w->index[slot] - 1] == sym) { return w->index[slot] - 1; }
+        slot = (slot + 1) & (w->index_size - 1);
+    }
+    w->syms[w->syms_count] = sym;
+    w->index[slot] = ++w->syms_count;
+    return w->syms_count - 1;
+}
+
+static void iwriter_value(iwriter *w, lval *v) {
+    if (w->depth == IMAGE_MAX_DEPTH) {
+        w->too_deep = 1;
+        return;
+    }
+    w->depth++;
+
+    ibuf *b = &w->values;
+    switch (v->type) {
+        case LVAL_NUM:
+            ibuf_byte(b, LVAL_NUM);
+            /* Zigzag so small negative numbers stay small */
+            ibuf_varint(b, ((unsigned long) v->num << 1) ^ (unsigned long) (v->num >> 63));
+            break;
+        case LVAL_ERR:
+            ibuf_byte(b, LVAL_ERR);
+            ibuf_string(b, v->err, strlen(v->err));
+            break;
+        case LVAL_SYM:
+            ibuf_byte(b, LVAL_SYM);
+            ibuf_varint(b, iwriter_sym(w, v->sym));
+            break;
+        case LVAL_STR:
+            ibuf_byte(b, LVAL_STR);
+            ibuf_string(b, v->str, strlen(v->str));
+            break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                char *name = lenv_builtin_name(v->builtin);
+                ibuf_byte(b, IMAGE_BUILTIN);
+                ibuf_string(b, name, strlen(name));
+                break;
+            }
+            ibuf_byte(b, IMAGE_LAMBDA);
+            iwriter_value(w, v->formals);
+            iwriter_value(w, v->body);
+            /* Arguments captured by partial application, 0 when there are none */
+            ibuf_varint(b, v->env ? v->env->count + 1 : 0);
+            for (int i = 0; v->env && i < v->env->count; i++) {
+                ibuf_varint(b, iwriter_sym(w, v->env->syms[i]));
+                iwriter_value(w, v->env->vals[i]);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            ibuf_byte(b, v->type);
+            ibuf_varint(b, v->count);
+            for (int i = 0; i < v->count; i++) { iwriter_value(w, v->cell[i]); }
+            break;
+    }
+    w->depth--;
+}
+
+/*
+ * Write 'magic', the symbol table (name and whether it has been bound locally)
+ * and then everything written to w->values so far to 'filename'.
+ */
+static lval *iwriter_finish(iwriter *w, char *magic, char *what, char *filename) {
+    ibuf head = {NULL, 0, 0};
+    ibuf_bytes(&head, magic, IMAGE_MAGIC_LEN);
+    ibuf_varint(&head, w->syms_count);
+    for (int i = 0; i < w->syms_count; i++) {
+        ibuf_string(&head, w->syms[i]->name, strlen(w->syms[i]->name));
+        ibuf_byte(&head, w->syms[i]->local);
+    }
+
+    lval *result = NULL;
+    FILE *f = NULL;
+    if (w->too_deep) {
+        result = lval_err("Could not save %s %s: value is nested too deeply", what, filename);
+    } else if (!(f = fopen(filename, "wb"))
+        || fwrite(head.data, 1, head.len, f) != head.len
+        || fwrite(w->values.data, 1, w->values.len, f) != w->values.len) {
+        result = lval_err("Could not save %s %s: %s", what, filename, strerror(errno));
+    }
+    if (f && fclose(f) != 0 && !result) {
+        result = lval_err("Could not save %s %s: %s", what, filename, strerror(errno));
+    }
+
+    free(head.data);
+    free(w->values.data);
+    free(w->syms);
+    free(w->index);
+    return result ? result : lval_sexpr();
+}
+
+/* Write the bindings of the global environment 'e' to 'filename', each as a symbol number and a value */
+lval *image_save(lenv *e, char *filename) {
+    while (e->parent) { e = e->parent; }
+
+    iwriter w = {{NULL, 0, 0}, NULL, 0, NULL, 0, 0, 0};
+    ibuf_varint(&w.values, e->count);
+    for (int i = 0; i < e->count; i++) {
+        ibuf_varint(&w.values, iwriter_sym(&w, e->syms[i]));
+        iwriter_value(&w, e->vals[i]);
+    }
+    return iwriter_finish(&w, IMAGE_MAGIC, "image", filename);
+}
+
+/* Write the value 'v' to 'filename' */
+lval *image_save_value(lval *v, char *filename) {
+    iwriter w = {{NULL, 0, 0}, NULL, 0, NULL, 0, 0, 0};
+    iwriter_value(&w, v);
+    return iwriter_finish(&w, IMAGE_DATA_MAGIC, "data", filename);
+}
+
+/* Reader state over the mapped image, 'bad' is set on anything malformed */
+typedef struct ireader {
+    char *p;
+    char *end;
+    lsym **syms;
+    unsigned long syms_count;
+    int bad;
+    lenv *e;
+
+    // Nesting of the value being read, past IMAGE_MAX_DEPTH the file is bad
+    int depth;
+
+    // Mapping the file is read from
+    char *data;
+    size_t size;
+} ireader;
+
+static unsigned char ireader_byte(ireader *r) {
+    if (r->p >= r->end) {
+        r->bad = 1;
+        return 0;
+    }
+    return (unsigned char) *r->p++;
+}
+
+static unsigned long ireader_varint(ireader *r) {
+    unsigned long x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char c = ireader_byte(r);
+        x |= (unsigned long) (c & 0x7f) << shift;
+        if (!(c & 0x80)) { return x; }
+    }
+    r->bad = 1;
+    return 0;
+}
+
+/* Length prefixed bytes, left in the mapping */
+static char *ireader_string(ireader *r, size_t *len) {
+    *len = ireader_varint(r);
+    if (r->bad || *len > (size_t) (r->end - r->p)) {
+        r->bad = 1;
+        *len = 0;
+        return r->p;
+    }
+    char *s = r->p;
+    r->p += *len;
+    return s;
+}
+
+static lsym *ireader_sym(ireader *r) {
+    unsigned long i = ireader_varint(r);
+    if (i >= r->syms_count) {
+        r->bad = 1;
+        return NULL;
+    }
+    return r->syms[i];
+}
+
+static lval *ireader_value(ireader *r);
+
+/* A list of n values of the given type, or NULL */
+static lval *ireader_list(ireader *r, int type) {
+    unsigned long n = ireader_varint(r);
+    lval *x = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+    for (unsigned long i = 0; i < n && !r->bad; i++) {
+        lval *y = ireader_value(r);
+        if (!y) { break; }
+        x = lval_add(x, y);
+    }
+    if (r->bad) {
+        lval_del(x);
+        return NULL;
+    }
+    return x;
+}
+
+static lval *ireader_lambda(ireader *r) {
+    lval *formals = ireader_value(r);
+    lval *body = formals ? ireader_value(r) : NULL;
+    if (!body || formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR) {
+        if (formals) { lval_del(formals); }
+        if (body) { lval_del(body); }
+        r->bad = 1;
+        return NULL;
+    }
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->type != LVAL_SYM) {
+            lval_del(formals);
+            lval_del(body);
+            r->bad = 1;
+            return NULL;
+        }
+    }
+
+    /* Compile against the global environment, lexical slots are guarded so this is always safe */
+    lval *f = builtin_lambda_make(r->e, formals, body);
+
+    unsigned long captured = ireader_varint(r);
+    if (captured) {
+        f->env = lenv_new();
+        for (unsigned long i = 0; i + 1 < captured && !r->bad; i++) {
+            lsym *sym = ireader_sym(r);
+            lval *v = sym ? ireader_value(r) : NULL;
+            if (!v) { break; }
+            lval *k = lval_lsym(sym);
+            lenv_put(f->env, k, v);
+            lval_del(k);
+            lval_del(v);
+        }
+    }
+    if (r->bad) {
+        lval_del(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* Read one value starting from its tag byte, or NULL if the image is malformed */
+static lval *ireader_tagged(ireader *r) {
+    size_t len;
+    char *s;
+    int tag = ireader_byte(r);
+    switch (tag) {
+        case LVAL_NUM: {
+            unsigned long x = ireader_varint(r);
+            return r->bad ? NULL : lval_num((long) (x >> 1) ^ -(long) (x & 1));
+        }
+        case LVAL_ERR:
+            s = ireader_string(r, &len);
+            return r->bad ? NULL : lval_err("%.*s", (int) len, s);
+        case LVAL_SYM: {
+            lsym *sym = ireader_sym(r);
+            return sym ? lval_lsym(sym) : NULL;
+        }
+        case LVAL_STR:
+            s = ireader_string(r, &len);
+            return r->bad ? NULL : lval_str_len(s, len);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return ireader_list(r, tag);
+        case IMAGE_BUILTIN: {
+            s = ireader_string(r, &len);
+            lbuiltin func = r->bad ? NULL : lenv_builtin_func(s, len);
+            if (!func) {
+                r->bad = 1;
+                return NULL;
+            }
+            return lval_fun(func);
+        }
+        case IMAGE_LAMBDA:
+            return ireader_lambda(r);
+    }
+    r->bad = 1;
+    return NULL;
+}
+
+/* Read one value, or NULL if the image is malformed or nested too deeply */
+static lval *ireader_value(ireader *r) {
+    if (r->depth == IMAGE_MAX_DEPTH) {
+        r->bad = 1;
+        return NULL;
+    }
+    r->depth++;
+    lval *v = ireader_tagged(r);
+    r->depth--;
+    return v;
+}
+
+/*
+ * Map 'filename' and read its symbol table, leaving 'r' at the values that
+ * follow. Returns NULL, or an error if it isn't a file of the kind 'magic'.
+ */
+static lval *ireader_open(ireader *r, lenv *e, char *magic, char *what, char *filename) {
+    *r = (ireader) {NULL, NULL, NULL, 0, 0, e, 0, NULL, 0};
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { return lval_err("Could not load %s %s: %s", what, filename, strerror(errno)); }
+
+    struct stat st;
+    char *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= IMAGE_MAGIC_LEN) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED || memcmp(data, magic, IMAGE_MAGIC_LEN) != 0) {
+        if (data != MAP_FAILED) { munmap(data, st.st_size); }
+        return lval_err("Could not load %s %s: not a lispy %s file", what, filename, what);
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    r->data = data;
+    r->size = st.st_size;
+    r->p = data + IMAGE_MAGIC_LEN;
+    r->end = data + st.st_size;
+
+    /* Symbol table, each entry is a length prefixed name and a flags byte */
+    r->syms_count = ireader_varint(r);
+    if (r->syms_count > r->size) { r->bad = 1; }
+    if (!r->bad) { r->syms = malloc(sizeof(lsym *) * (r->syms_count + 1)); }
+    for (unsigned long i = 0; i < r->syms_count && !r->bad; i++) {
+        size_t len;
+        char *name = ireader_string(r, &len);
+        unsigned char flags = ireader_byte(r);
+        if (r->bad) { break; }
+        r->syms[i] = lsym_intern_len(name, len);
+        if (flags & 1) { r->syms[i]->local = 1; }
+    }
+    return NULL;
+}
+
+/* Unmap the file, returning an error if anything in it was malformed */
+static lval *ireader_close(ireader *r, char *what, char *filename) {
+    munmap(r->data, r->size);
+    free(r->syms);
+    return r->bad ? lval_err("Could not load %s %s: file is corrupt", what, filename) : NULL;
+}
+
+/*
+ * Define every binding in the image 'filename' in the global environment 'e'.
+ * Bindings are read into a separate environment first so 'e' is left alone
+ * unless the whole image is good.
+ */
+lval *image_load(lenv *e, char *filename) {
+    while (e->parent) { e = e->parent; }
+
+    ireader r;
+    lval *err = ireader_open(&r, e, IMAGE_MAGIC, "image", filename);
+    if (err) { return err; }
+
+    lenv *bindings = lenv_new();
+    unsigned long count = r.bad ? 0 : ireader_varint(&r);
+    for (unsigned long i = 0; i < count && !r.bad; i++) {
+        lsym *sym = ireader_sym(&r);
+        lval *v = sym ? ireader_value(&r) : NULL;
+        if (!v) { break; }
+        lval *k = lval_lsym(sym);
+        lenv_put(bindings, k, v);
+        lval_del(k);
+        lval_del(v);
+    }
+
+    err = ireader_close(&r, "image", filename);
+    for (int i = 0; !err && i < bindings->count; i++) {
+        lval *k = lval_lsym(bindings->syms[i]);
+        lenv_put(e, k, bindings->vals[i]);
+        lval_del(k);
+    }
+    lenv_del(bindings);
+    return err ? err : lval_sexpr();
+}
+
+/* Read back the value written to 'filename', functions in it are compiled against 'e' */
+lval *image_load_value(lenv *e, char *filename) {
+    while (e->parent) { e = e->parent; }
+
+    ireader r;
+    lval *err = ireader_open(&r, e, IMAGE_DATA_MAGIC, "data", filename);
+    if (err) { return err; }
+
+    lval *v = r.bad ? NULL : ireader_value(&r);
+    err = ireader_close(&r, "data", filename);
+    if (err) {
+        if (v) { lval_del(v); }
+        return err;
+    }
+    return v;
+}
@@ -0,0 +1,22 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "lenv.h"
+#include "lval.h"
+
+/*
+ * Binary images of the global environment, and of single values for save and
+ * restore. Symbols are written once in a table and referred to by position,
+ * numbers and lengths are varints, strings are length prefixed, and builtins
+ * are written by name so a file survives the interpreter being rebuilt.
+ */
+
+lval *image_save(lenv *e, char *filename);
+
+lval *image_load(lenv *e, char *filename);
+
+lval *image_save_value(lval *v, char *filename);
+
+lval *image_load_value(lenv *e, char *filename);
+
+#endif
@@ -1,65 +1,179 @@
 #include "mpc.h"
 #include "lenv.h"
 #include "builtins.h"
+#include "gc.h"
+#include "slab.h"
+#include "vm.h"
+
+static lenv *lenv_alloc() {
+#ifdef LISPY_GC
+    return gc_alloc(GC_LENV, sizeof(lenv));
+#else
+    return slab_alloc(sizeof(lenv));
+#endif
+}
 
 lenv *lenv_new() {
-    lenv *e = malloc(sizeof(lenv));
+    lenv *e = lenv_alloc();
+    e->refs = 1;
     e->parent = NULL;
     e->count = 0;
+    e->capacity = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index_size = 0;
+    e->index = NULL;
+    e->code = NULL;
     return e;
 }
 
+/* Record the binding at position pos in the index */
+static void lenv_index_insert(lenv *e, int pos) {
+    int mask = e->index_size - 1;
+    int slot = (int) (e->syms[pos]->hash & mask);
+    while (e->index[slot]) { slot = (slot + 1) & mask; }
+    e->index[slot] = pos + 1;
+}
+
+/* Throw away the index and rebuild it with size slots */
+static void lenv_index_rebuild(lenv *e, int size) {
+    free(e->index);
+    e->index_size = size;
+    e->index = calloc(size, sizeof(int));
+    for (int i = 0; i < e->count; i++) {
+        lenv_index_insert(e, i);
+    }
+}
+
+/* Return the index slot pointing at position pos */
+static int lenv_index_slot(lenv *e, int pos) {
+    int mask = e->index_size - 1;
+    int slot = (int) (e->syms[pos]->hash & mask);
+    while (e->index[slot] != pos + 1) { slot = (slot + 1) & mask; }
+    return slot;
+}
+
+/* Empty an index slot, shifting back any entries that probed past it */
+static void lenv_index_remove(lenv *e, int slot) {
+    int mask = e->index_size - 1;
+    int hole = slot;
+    e->index[hole] = 0;
+    for (int i = (hole + 1) & mask; e->index[i]; i = (i + 1) & mask) {
+        int home = (int) (e->syms[e->index[i] - 1]->hash & mask);
+        /* Entry can move into the hole if its home is not between the hole and it */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            e->index[hole] = e->index[i];
+            e->index[i] = 0;
+            hole = i;
+        }
+    }
+}
+
+/* Find the position of a symbol in this environment only, or -1 */
+int lenv_find(lenv *e, lsym *sym) {
+    if (!e->index) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->syms[i] == sym) { return i; }
+        }
+        return -1;
+    }
+    int mask = e->index_size - 1;
+    for (int slot = (int) (sym->hash & mask); e->index[slot]; slot = (slot + 1) & mask) {
+        int pos = e->index[slot] - 1;
+        if (e->syms[pos] == sym) { return pos; }
+    }
+    return -1;
+}
+
 lenv *lenv_copy(lenv *e) {
-    lenv *n = malloc(sizeof(lenv));
+    lenv *n = lenv_alloc();
+    n->refs = 1;
     n->parent = e->parent;
+    if (n->parent) { n->parent->refs++; }
     n->count = e->count;
-    n->syms = malloc(sizeof(char *) * n->count);
+    n->capacity = e->count;
+    n->syms = malloc(sizeof(lsym *) * n->count);
     n->vals = malloc(sizeof(lval *) * n->count);
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
+        n->syms[i] = e->syms[i];
         n->vals[i] = lval_copy(e->vals[i]);
     }
+    n->index_size = e->index_size;
+    n->index = NULL;
+    if (e->index) {
+        n->index = malloc(sizeof(int) * n->index_size);
+        memcpy(n->index, e->index, sizeof(int) * n->index_size);
+    }
+    n->code = e->code;
+    if (n->code) { n->code->refs++; }
     return n;
 }
 
 lval *lenv_get(lenv *e, lval *k) {
-    /* Iterate over all items in environment */
-    for (int i = 0; i < e->count; i++) {
-        /* Check if the stored string matches the symbol */
-        /* If it does return a copy of its value */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
-    }
-    /* If no symbol found check in parent, otherwise return an error */
-    if (e->parent) {
-        return lenv_get(e->parent, k);
+    /* Walk up the environments until the symbol is found */
+    for (; e; e = e->parent) {
+        int i = lenv_find(e, k->sym);
+        /* If it is return a copy of its value */
+        if (i >= 0) { return lval_copy(e->vals[i]); }
     }
-    return lval_err("Unbound symbol '%s'", k->sym);
+    return lval_err("Unbound symbol '%s'", k->sym->name);
 }
 
 void lenv_put(lenv *e, lval *k, lval *v) {
-    /* See if variable already exists */
-    for (int i = 0; i < e->count; i++) {
-        /* Delete and replace if element found */
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    /* See if variable already exists, delete and replace if found */
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_copy(v);
+        return;
+    }
+
+    /* If nothing found grow the space for new entries geometrically */
+    if (e->count == e->capacity) {
+        e->capacity = e->capacity ? e->capacity * 2 : 4;
+        e->vals = realloc(e->vals, sizeof(lval *) * e->capacity);
+        e->syms = realloc(e->syms, sizeof(lsym *) * e->capacity);
     }
 
-    /* If nothing found reallocate space for new entry */
+    /* Copy contents of lval into new location, symbols are interned so just share them */
+    e->vals[e->count] = lval_copy(v);
+    e->syms[e->count] = k->sym;
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
-    /* Copy contents of lval and symbol strings into new location */
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+
+    /* Keep the index at most half full */
+    if (e->index && e->count * 2 <= e->index_size) {
+        lenv_index_insert(e, e->count - 1);
+    } else if (e->count > LENV_INDEX_MIN) {
+        lenv_index_rebuild(e, e->index_size ? e->index_size * 2 : LENV_INDEX_MIN * 4);
+    }
+}
+
+/* Whether every symbol bound in 'p' is also bound in 'e' */
+int lenv_covers(lenv *e, lenv *p) {
+    for (int i = 0; i < p->count; i++) {
+        if (lenv_find(e, p->syms[i]) < 0) { return 0; }
+    }
+    return 1;
+}
+
+/* Unbind a symbol from this environment only, returning whether it was bound */
+int lenv_remove(lenv *e, lval *k) {
+    int i = lenv_find(e, k->sym);
+    if (i < 0) { return 0; }
+
+    if (e->index) {
+        lenv_index_remove(e, lenv_index_slot(e, i));
+        /* Later bindings move down one place to keep insertion order */
+        for (int slot = 0; slot < e->index_size; slot++) {
+            if (e->index[slot] > i + 1) { e->index[slot]--; }
+        }
+    }
+
+    lval_del(e->vals[i]);
+    memmove(e->vals + i, e->vals + i + 1, sizeof(lval *) * (e->count - i - 1));
+    memmove(e->syms + i, e->syms + i + 1, sizeof(lsym *) * (e->count - i - 1));
+    e->count--;
+    return 1;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v) {
@@ -67,38 +181,71 @@ void lenv_def(lenv *e, lval *k, lval *v) {
     lenv_put(e, k, v);
 }
 
-void lenv_add_builtins(lenv *e) {
+/* Every builtin and the name it is bound to at startup */
+static struct {
+    char *name;
+    lbuiltin func;
+} lenv_builtins[] = {
     /* List functions */
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+    {"list", builtin_list},
+    {"head", builtin_head},
+    {"tail", builtin_tail},
+    {"eval", builtin_eval},
+    {"join", builtin_join},
 
     /* Mathematical functions */
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    {"+", builtin_add},
+    {"-", builtin_sub},
+    {"*", builtin_mul},
+    {"/", builtin_div},
 
     /* Comparison functions */
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "if", builtin_if);
+    {">", builtin_gt},
+    {"<", builtin_lt},
+    {">=", builtin_ge},
+    {"<=", builtin_le},
+    {"==", builtin_eq},
+    {"!=", builtin_ne},
+    {"if", builtin_if},
 
     /* Variable functions */
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
-    lenv_add_builtin(e, "\\", builtin_lambda);
+    {"def", builtin_def},
+    {"=", builtin_put},
+    {"\\", builtin_lambda},
 
     // string functions
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
+    {"load", builtin_load},
+    {"print", builtin_print},
+    {"show", builtin_show},
+    {"error", builtin_error},
+    {"save", builtin_save},
+    {"restore", builtin_restore},
+};
+
+#define LENV_BUILTINS_COUNT ((int) (sizeof(lenv_builtins) / sizeof(lenv_builtins[0])))
+
+void lenv_add_builtins(lenv *e) {
+    for (int i = 0; i < LENV_BUILTINS_COUNT; i++) {
+        lenv_add_builtin(e, lenv_builtins[i].name, lenv_builtins[i].func);
+    }
+}
+
+/* Name a builtin is registered under, or NULL */
+char *lenv_builtin_name(lbuiltin func) {
+    for (int i = 0; i < LENV_BUILTINS_COUNT; i++) {
+        if (lenv_builtins[i].func == func) { return lenv_builtins[i].name; }
+    }
+    return NULL;
+}
+
+/* Builtin registered under a name, or NULL */
+lbuiltin lenv_builtin_func(char *name, size_t len) {
+    for (int i = 0; i < LENV_BUILTINS_COUNT; i++) {
+        if (strlen(lenv_builtins[i].name) == len && memcmp(lenv_builtins[i].name, name, len) == 0) {
+            return lenv_builtins[i].func;
+        }
+    }
+    return NULL;
 }
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
@@ -110,11 +257,21 @@ void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
 }
 
 void lenv_del(lenv *e) {
-    for (int i = 0; i < e->count; i++) {
-        lval_del(e->vals[i]);
-        free(e->syms[i]);
+#ifdef LISPY_GC
+    /* Unreachable environments are freed by the collector */
+    return;
+#endif
+    /* Release parents in a loop as a long chain can be freed at once */
+    while (e && --e->refs == 0) {
+        lenv *parent = e->parent;
+        for (int i = 0; i < e->count; i++) {
+            lval_del(e->vals[i]);
+        }
+        free(e->vals);
+        free(e->syms);
+        free(e->index);
+        if (e->code) { lcode_del(e->code); }
+        slab_free(e, sizeof(lenv));
+        e = parent;
     }
-    free(e->vals);
-    free(e->syms);
-    free(e);
 }
@@ -2,28 +2,57 @@
 #define LENV_H
 
 #include "lval.h"
+#include "lsym.h"
 
+/* Environments smaller than this are searched linearly, larger ones get a hash index */
+#define LENV_INDEX_MIN 8
+
+/*
+ * A frame holds the bindings of one call and keeps its parent alive, frames
+ * captured by partially applied functions have no parent and are shared.
+ */
 struct lenv {
+    int refs;
     lenv *parent;
+
+    // Bindings, kept densely in insertion order
     int count;
-    char **syms;
+    int capacity;
+    lsym **syms;
     lval **vals;
+
+    // Open addressing index into syms/vals, each slot holds position + 1 (0 is empty)
+    int index_size;
+    int *index;
+
+    // Compiled function this is the frame of, if any
+    lcode *code;
 };
 
 lenv *lenv_new();
 
 lenv *lenv_copy(lenv *e);
 
+int lenv_find(lenv *e, lsym *sym);
+
 lval *lenv_get(lenv *e, lval *k);
 
 void lenv_put(lenv *e, lval *k, lval *v);
 
 void lenv_def(lenv *e, lval *k, lval *v);
 
+int lenv_remove(lenv *e, lval *k);
+
+int lenv_covers(lenv *e, lenv *p);
+
 void lenv_add_builtins(lenv *e);
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func);
 
+char *lenv_builtin_name(lbuiltin func);
+
+lbuiltin lenv_builtin_func(char *name, size_t len);
+
 void lenv_del(lenv *e);
 
 #endif
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lsym.h"
+
+/* Process wide intern table, open addressing over a power of two number of slots */
+static lsym **table = NULL;
+static int table_size = 0;
+static int table_count = 0;
+
+lsym *lsym_amp = NULL;
+lsym *lsym_if = NULL;
+
+/* FNV-1a hash of a symbol name */
+static unsigned long lsym_hash(char *s, size_t len) {
+    unsigned long h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lsym_grow() {
+    int old_size = table_size;
+    lsym **old = table;
+
+    table_size = table_size ? table_size * 2 : 256;
+    table = calloc(table_size, sizeof(lsym *));
+    for (int i = 0; i < old_size; i++) {
+        if (!old[i]) { continue; }
+        int slot = (int) (old[i]->hash & (table_size - 1));
+        while (table[slot]) { slot = (slot + 1) & (table_size - 1); }
+        table[slot] = old[i];
+    }
+    free(old);
+}
+
+lsym *lsym_intern(char *name) {
+    return lsym_intern_len(name, strlen(name));
+}
+
+lsym *lsym_intern_len(char *name, size_t len) {
+    /* Intern the well known symbols along with the first one */
+    if (!table) {
+        lsym_grow();
+        lsym_amp = lsym_intern("&");
+        lsym_if = lsym_intern("if");
+    }
+
+    /* Keep the table at most half full */
+    if ((table_count + 1) * 2 > table_size) { lsym_grow(); }
+
+    unsigned long hash = lsym_hash(name, len);
+    int slot = (int) (hash & (table_size - 1));
+    while (table[slot]) {
+        if (table[slot]->hash == hash && strncmp(table[slot]->name, name, len) == 0
+            && table[slot]->name[len] == '\0') {
+            return table[slot];
+        }
+        slot = (slot + 1) & (table_size - 1);
+    }
+
+    /* First time this name has been seen so store a copy of it */
+    lsym *s = malloc(sizeof(lsym));
+    s->hash = hash;
+    s->local = 0;
+    s->name = malloc(len + 1);
+    memcpy(s->name, name, len);
+    s->name[len] = '\0';
+    table[slot] = s;
+    table_count++;
+    return s;
+}
+
+void lsym_cleanup() {
+    for (int i = 0; i < table_size; i++) {
+        if (!table[i]) { continue; }
+        free(table[i]->name);
+        free(table[i]);
+    }
+    free(table);
+    table = NULL;
+    table_size = 0;
+    table_count = 0;
+    lsym_amp = NULL;
+    lsym_if = NULL;
+}
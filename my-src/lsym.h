@@ -0,0 +1,25 @@
+#ifndef LSYM_H
+#define LSYM_H
+
+#include <stddef.h>
+
+/* An interned symbol name, there is only ever one lsym per distinct name */
+typedef struct lsym {
+    unsigned long hash;
+    char *name;
+
+    // Set once the symbol is bound anywhere but the global environment, until then it always names a global
+    int local;
+} lsym;
+
+/* Symbols the evaluator compares against, set up with the table */
+extern lsym *lsym_amp;
+extern lsym *lsym_if;
+
+lsym *lsym_intern(char *name);
+
+lsym *lsym_intern_len(char *name, size_t len);
+
+void lsym_cleanup();
+
+#endif
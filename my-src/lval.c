@@ -4,6 +4,9 @@
 #include "lval.h"
 #include "lenv.h"
 #include "mpc.h"
+#include "gc.h"
+#include "slab.h"
+#include "vm.h"
 
 char *ltype_name(int t) {
     switch (t) {
@@ -26,84 +29,193 @@ char *ltype_name(int t) {
     }
 }
 
-void lval_expr_print(lval *v, char open, char close) {
-    putchar(open);
+/* Printed output is handed to stdio in chunks of about this size */
+#define LBUF_CHUNK 65536
+
+/* Buffer for printing to stdout, kept between prints so printing doesn't allocate */
+lbuf lval_stdout = {NULL, 0, 0, NULL};
+
+static void lbuf_reserve(lbuf *b, size_t n) {
+    if (b->len + n <= b->capacity) { return; }
+    while (b->len + n > b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 256;
+    }
+    b->data = realloc(b->data, b->capacity);
+}
+
+void lbuf_put(lbuf *b, char *s, size_t n) {
+    if (b->out && b->len + n > LBUF_CHUNK) { lbuf_flush(b); }
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void lbuf_char(lbuf *b, char c) {
+    if (b->len == b->capacity) {
+        if (b->out && b->len >= LBUF_CHUNK) { lbuf_flush(b); }
+        lbuf_reserve(b, 1);
+    }
+    b->data[b->len++] = c;
+}
+
+/* Write out what has been printed so far if the buffer has somewhere to go */
+void lbuf_flush(lbuf *b) {
+    if (!b->out || !b->len) { return; }
+    fwrite(b->data, 1, b->len, b->out);
+    b->len = 0;
+}
+
+static void lbuf_num(lbuf *b, long x) {
+    /* Digits are produced backwards, the magnitude is unsigned so LONG_MIN works */
+    char digits[24];
+    int n = sizeof(digits);
+    unsigned long u = x < 0 ? 0 - (unsigned long) x : (unsigned long) x;
+    do {
+        digits[--n] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (x < 0) { digits[--n] = '-'; }
+    lbuf_put(b, digits + n, sizeof(digits) - n);
+}
+
+/* How each character is written inside a string, the same escapes as mpcf_escape */
+static const char *lval_escapes[256] = {
+    ['\a'] = "\\a", ['\b'] = "\\b", ['\f'] = "\\f", ['\n'] = "\\n", ['\r'] = "\\r",
+    ['\t'] = "\\t", ['\v'] = "\\v", ['\\'] = "\\\\", ['\''] = "\\'", ['"'] = "\\\"",
+};
+
+/* Write a string between quotes, copying runs of plain characters at once */
+static void lval_write_str(lbuf *b, char *s) {
+    lbuf_char(b, '"');
+    char *run = s;
+    for (; *s; s++) {
+        const char *esc = lval_escapes[(unsigned char) *s];
+        if (!esc) { continue; }
+        lbuf_put(b, run, s - run);
+        lbuf_put(b, (char *) esc, 2);
+        run = s + 1;
+    }
+    lbuf_put(b, run, s - run);
+    lbuf_char(b, '"');
+}
+
+static void lval_write_expr(lbuf *b, lval *v, char open, char close) {
+    lbuf_char(b, open);
     for (int i = 0; i < v->count; i++) {
         /* Print value contained within */
-        lval_print(v->cell[i]);
+        lval_write(b, v->cell[i]);
 
         /* Don't print trailing space if last element */
         if (i != (v->count - 1)) {
-            putchar(' ');
+            lbuf_char(b, ' ');
         }
     }
-    putchar(close);
+    lbuf_char(b, close);
 }
 
-void lval_print_str(lval *v) {
-    // make a copy of the string
-    char *escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
-    // escape it
-    escaped = mpcf_escape(escaped);
-    // print it between " characters
-    printf("\"%s\"", escaped);
-    free(escaped);
-}
-
-/* Print an "lval" */
-void lval_print(lval *v) {
+/* Print an "lval" into a buffer */
+void lval_write(lbuf *b, lval *v) {
     switch (v->type) {
         case LVAL_NUM:
-            printf("%li", v->num);
+            lbuf_num(b, v->num);
             break;
         case LVAL_ERR:
-            printf("Error: %s", v->err);
+            lbuf_put(b, "Error: ", 7);
+            lbuf_put(b, v->err, strlen(v->err));
             break;
         case LVAL_SYM:
-            printf("%s", v->sym);
+            lbuf_put(b, v->sym->name, strlen(v->sym->name));
             break;
         case LVAL_STR:
-            lval_print_str(v);
+            lval_write_str(b, v->str);
             break;
         case LVAL_FUN:
             if (v->builtin) {
-                printf("<function>");
+                lbuf_put(b, "<function>", 10);
             } else {
-                printf("(\\ ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+                lbuf_put(b, "(\\ ", 3);
+                lval_write(b, v->formals);
+                lbuf_char(b, ' ');
+                lval_write(b, v->body);
+                lbuf_char(b, ')');
             }
             break;
         case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
+            lval_write_expr(b, v, '(', ')');
             break;
         case LVAL_QEXPR:
-            lval_expr_print(v, '{', '}');
+            lval_write_expr(b, v, '{', '}');
             break;
     }
 }
 
+/* Print an "lval" */
+void lval_print(lval *v) {
+    lval_stdout.out = stdout;
+    lval_write(&lval_stdout, v);
+    lbuf_flush(&lval_stdout);
+}
+
 /* Print an "lval" followed by a newline */
 void lval_println(lval *v) {
-    lval_print(v);
-    putchar('\n');
+    lval_stdout.out = stdout;
+    lval_write(&lval_stdout, v);
+    lbuf_char(&lval_stdout, '\n');
+    lbuf_flush(&lval_stdout);
+}
+
+void lval_cleanup() {
+    free(lval_stdout.data);
+    lval_stdout = (lbuf) {NULL, 0, 0, NULL};
+}
+
+/* Bytes needed by a value of the given type, builtins only use the first function field */
+static size_t lval_type_size(int type, int builtin) {
+    switch (type) {
+        case LVAL_NUM:
+            return offsetof(lval, num) + sizeof(long);
+        case LVAL_ERR:
+            return offsetof(lval, err) + sizeof(char *);
+        case LVAL_SYM:
+            return offsetof(lval, sym) + sizeof(lsym *);
+        case LVAL_STR:
+            return offsetof(lval, str) + sizeof(char *);
+        case LVAL_FUN:
+            return builtin ? offsetof(lval, builtin) + sizeof(lbuiltin) : sizeof(lval);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return offsetof(lval, cell) + sizeof(lval **);
+        default:
+            return sizeof(lval);
+    }
+}
+
+size_t lval_size(lval *v) {
+    return lval_type_size(v->type, v->type == LVAL_FUN && v->builtin);
+}
+
+static lval *lval_alloc(int type, int builtin) {
+    size_t size = lval_type_size(type, builtin);
+#ifdef LISPY_GC
+    lval *v = gc_alloc(GC_LVAL, size);
+#else
+    lval *v = slab_alloc(size);
+#endif
+    v->type = type;
+    v->refs = 1;
+    return v;
 }
 
 /* Construct a pointer to a new Number lval */
 lval *lval_num(long x) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    lval *v = lval_alloc(LVAL_NUM, 0);
     v->num = x;
     return v;
 }
 
 /* Construct a pointer to a new Error lval */
 lval *lval_err(char *fmt, ...) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval *v = lval_alloc(LVAL_ERR, 0);
 
     /* Create a va list and initialize it */
     va_list va;
@@ -125,68 +237,121 @@ lval *lval_err(char *fmt, ...) {
 
 /* Construct a pointer to a new Symbol lval */
 lval *lval_sym(char *s) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    lval *v = lval_alloc(LVAL_SYM, 0);
+    v->sym = lsym_intern(s);
+    return v;
+}
+
+lval *lval_sym_len(char *s, size_t len) {
+    lval *v = lval_alloc(LVAL_SYM, 0);
+    v->sym = lsym_intern_len(s, len);
+    return v;
+}
+
+lval *lval_lsym(lsym *sym) {
+    lval *v = lval_alloc(LVAL_SYM, 0);
+    v->sym = sym;
     return v;
 }
 
 lval *lval_str(char *s) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
+    lval *v = lval_alloc(LVAL_STR, 0);
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
     return v;
 }
 
+lval *lval_str_len(char *s, size_t len) {
+    lval *v = lval_alloc(LVAL_STR, 0);
+    v->str = malloc(len + 1);
+    memcpy(v->str, s, len);
+    v->str[len] = '\0';
+    return v;
+}
+
 /* Construct a pointer to a new empty Sexpr lval */
 lval *lval_sexpr() {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval *v = lval_alloc(LVAL_SEXPR, 0);
     v->count = 0;
+    v->capacity = 0;
+    v->offset = 0;
     v->cell = NULL;
     return v;
 }
 
 /* Construct a pointer to a new empty Qexpr lval */
 lval *lval_qexpr() {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval *v = lval_alloc(LVAL_QEXPR, 0);
     v->count = 0;
+    v->capacity = 0;
+    v->offset = 0;
     v->cell = NULL;
     return v;
 }
 
 lval *lval_fun(lbuiltin builtin) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval *v = lval_alloc(LVAL_FUN, 1);
     v->builtin = builtin;
     return v;
 }
 
 lval *lval_lambda(lval *formals, lval *body) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval *v = lval_alloc(LVAL_FUN, 0);
 
     // Builtin being defined is how we know if it's a user function or a builtin
     v->builtin = NULL;
-    v->env = lenv_new();
+    // Arguments are only captured once it is partially applied
+    v->env = NULL;
     v->formals = formals;
     v->body = body;
+    v->code = NULL;
+
+    // Formals are bound in the function's own frame so they may shadow globals
+    for (int i = 0; i < formals->count; i++) {
+        formals->cell[i]->sym->local = 1;
+    }
     return v;
 }
 
 lval *lval_add(lval *v, lval *x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    v->cell[v->count - 1] = x;
+    v = lval_own(v);
+
+    if (v->offset + v->count == v->capacity) {
+        lval **base = v->cell - v->offset;
+        if (v->offset > 0 && v->offset >= v->count) {
+            /* At least half the space is left over from popping the front so slide back */
+            memmove(base, v->cell, sizeof(lval *) * v->count);
+        } else {
+            /* Otherwise double the space so adding is amortised O(1) */
+            int capacity = v->capacity ? v->capacity * 2 : 4;
+            base = slab_realloc(base, sizeof(lval *) * v->capacity, sizeof(lval *) * capacity);
+            memmove(base, base + v->offset, sizeof(lval *) * v->count);
+            v->capacity = capacity;
+        }
+        v->offset = 0;
+        v->cell = base;
+    }
+
+    v->cell[v->count++] = x;
     return v;
 }
 
+/* Share a value by taking another reference to it */
 lval *lval_copy(lval *v) {
-    lval *x = malloc(sizeof(lval));
-    x->type = v->type;
+#ifdef LISPY_GC
+    // the collector owns lifetimes, refs only records that the value is shared
+    v->refs = 2;
+#else
+    v->refs++;
+#endif
+    return v;
+}
+
+/* Return a version of v that is safe to mutate, copying it first if it is shared */
+lval *lval_own(lval *v) {
+    if (v->refs == 1) { return v; }
+
+    lval *x = lval_alloc(v->type, v->type == LVAL_FUN && v->builtin);
     switch (v->type) {
         /* Copy functions and numbers directly */
         case LVAL_FUN:
@@ -194,167 +359,218 @@ lval *lval_copy(lval *v) {
                 x->builtin = v->builtin;
             } else {
                 x->builtin = NULL;
-                x->env = lenv_copy(v->env);
+                x->env = v->env;
+                if (x->env) { x->env->refs++; }
                 x->formals = lval_copy(v->formals);
                 x->body = lval_copy(v->body);
+                x->code = v->code;
+                if (x->code) { x->code->refs++; }
             }
             break;
         case LVAL_NUM:
             x->num = v->num;
             break;
 
+            /* Symbols are interned so the name is shared */
+        case LVAL_SYM:
+            x->sym = v->sym;
+            break;
+
             /* Copy strings using malloc and strcpy */
         case LVAL_ERR:
             x->err = malloc(strlen(v->err) + 1);
             strcpy(x->err, v->err);
             break;
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
-            break;
         case LVAL_STR:
             x->str = malloc(strlen(v->str) + 1);
             strcpy(x->str, v->str);
             break;
 
-            /* Copy lists by copying each sub-expression */
+            /* Copy lists by sharing each sub-expression */
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
-            x->cell = malloc(sizeof(lval *) * x->count);
+            x->capacity = v->count;
+            x->offset = 0;
+            x->cell = slab_alloc(sizeof(lval *) * x->count);
             for (int i = 0; i < x->count; i++) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
             break;
     }
+
+#ifndef LISPY_GC
+    /* Give up our reference to the shared original */
+    v->refs--;
+#endif
     return x;
 }
 
-/* Remove lval at index i and shift rest of the list */
+/* Remove lval at index i and shift rest of the list, v must not be shared */
 lval *lval_pop(lval *v, int i) {
     /* Find the element at "i" */
     lval *x = v->cell[i];
 
-    /* Shift memory after the item at "i" over the top */
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+    if (i == 0) {
+        /* Popping the front just moves the start along */
+        v->cell++;
+        v->offset++;
+    } else {
+        /* Shift memory after the item at "i" over the top */
+        memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+    }
 
-    /* Decrease the count of items in the list */
+    /* Decrease the count of items in the list, the space is kept for reuse */
     v->count--;
-
-    /* Reallocate the memory used */
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+    if (v->count == 0) {
+        v->cell -= v->offset;
+        v->offset = 0;
+    }
     return x;
 }
 
 /* Extract lval at index i and delete list */
 lval *lval_take(lval *v, int i) {
+    /* If the list is shared just take a reference to the element */
+    if (v->refs > 1) {
+        lval *x = lval_copy(v->cell[i]);
+        lval_del(v);
+        return x;
+    }
     lval *x = lval_pop(v, i);
     lval_del(v);
     return x;
 }
 
 lval *lval_join(lval *x, lval *y) {
-    /* For each cell in 'y' add it to 'x' */
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    /* For each cell in 'y' add a reference to it to 'x' */
+    for (int i = 0; i < y->count; i++) {
+        x = lval_add(x, lval_copy(y->cell[i]));
     }
 
-    /* Delete the empty 'y' and return 'x' */
+    /* Delete 'y' and return 'x' */
     lval_del(y);
     return x;
 }
 
-lval *lval_call(lenv *e, lval *f, lval *a) {
-    // if builtin then just call that
-    if (f->builtin) { return f->builtin(e, a); }
+/* Error for a malformed '&' in the formals, cleaning up the frame being bound */
+static lval *lval_bind_amp_err(lenv *x) {
+    lenv_del(x);
+    return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+}
+
+/* Bind the arguments 'a' to user function 'f', consuming 'a'. The new frame
+ * starts from any arguments 'f' captured by partial application and is never
+ * shared with it. Returns NULL with the frame in *frame if every formal is
+ * bound, otherwise an error or a partially applied function capturing it. */
+static lval *lval_bind(lenv *e, lval *f, lval *a, lenv **frame) {
+    lenv *x = f->env ? lenv_copy(f->env) : lenv_new();
+    if (!x->code && f->code) {
+        x->code = f->code;
+        x->code->refs++;
+    }
 
-    // record argument counts
+    lval *formals = f->formals;
     int given = a->count;
-    int total = f->formals->count;
+    int total = formals->count;
+    int i = 0;
 
     // while arguments still remain to be processed
-    while (a->count) {
+    while (a && a->count) {
         // if we've run out of formal arguments to bind
-        if (f->formals->count == 0) {
+        if (i == total) {
             lval_del(a);
+            lenv_del(x);
             return lval_err("Function passed too many arguments. Got %i, expected %i.", given, total);
         }
 
-        // pop the first symbol from the formals
-        lval *sym = lval_pop(f->formals, 0);
-        // special case to deal with '&'
-        if (strcmp(sym->sym, "&") == 0) {
-            // ensure & is followed by another symbol
-            if (f->formals->count != 1) {
+        // special case to deal with '&', the next formal is bound to the remaining arguments
+        if (formals->cell[i]->sym == lsym_amp) {
+            if (total - i != 2) {
                 lval_del(a);
-                return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+                return lval_bind_amp_err(x);
             }
-            // Next formal should be bound to remaining arguments
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+            lval *val = builtin_list(e, a);
+            lenv_put(x, formals->cell[i + 1], val);
+            lval_del(val);
+            a = NULL;
+            i += 2;
             break;
         }
-        // pop the next argument from the list
+
+        // bind the next argument to the next formal
         lval *val = lval_pop(a, 0);
-        // bind a copy into the functions environment
-        lenv_put(f->env, sym, val);
-        // delete a symbol and value
-        lval_del(sym);
+        lenv_put(x, formals->cell[i], val);
         lval_del(val);
+        i++;
     }
 
     // argument list is now bound and can be cleaned up
-    lval_del(a);
+    if (a) { lval_del(a); }
 
     // if '&' remains in formal list bind to empty list
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        // check to ensure that & is not passed invalidly
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-        }
-        // pop and delete '&' symbol
-        lval_del(lval_pop(f->formals, 0));
-        // pop next symbol and create empty list
-        lval *sym = lval_pop(f->formals, 0);
+    if (i < total && formals->cell[i]->sym == lsym_amp) {
+        if (total - i != 2) { return lval_bind_amp_err(x); }
         lval *val = lval_qexpr();
-        // bind to environment and delete
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
+        lenv_put(x, formals->cell[i + 1], val);
         lval_del(val);
+        i += 2;
+    }
+
+    // if all formals have been bound the frame's parent is the evaluation environment
+    if (i == total) {
+        x->parent = e;
+        e->refs++;
+        *frame = x;
+        return NULL;
     }
 
-    // if all formals have been bound: evaluate
-    if (f->formals->count == 0) {
-        // set environment parent to evaluation environment
-        f->env->parent = e;
-        // evaluate and return
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    // otherwise capture the frame in a function taking the remaining formals
+    lval *p = lval_alloc(LVAL_FUN, 0);
+    p->builtin = NULL;
+    p->env = x;
+    p->formals = lval_qexpr();
+    for (int j = i; j < total; j++) {
+        p->formals = lval_add(p->formals, lval_copy(formals->cell[j]));
     }
-    // otherwise return partially bound function
-    return lval_copy(f);
+    p->body = lval_copy(f->body);
+    p->code = f->code;
+    if (p->code) { p->code->refs++; }
+    return p;
+}
+
+/* Body of a fully bound function, ready to evaluate in its environment */
+static lval *lval_body(lval *f) {
+    lval *x = lval_own(lval_copy(f->body));
+    x->type = LVAL_SEXPR;
+    return x;
 }
 
 void lval_del(lval *v) {
+#ifdef LISPY_GC
+    /* Unreachable values are freed by the collector */
+    return;
+#endif
+    /* Only free the value once the last reference is gone */
+    if (--v->refs > 0) { return; }
+
     switch (v->type) {
-        /* Do nothing special for number or fun types */
+        /* Do nothing special for number, interned symbol or fun types */
         case LVAL_NUM:
+        case LVAL_SYM:
             break;
         case LVAL_FUN:
             if (!v->builtin) {
-                lenv_del(v->env);
+                if (v->env) { lenv_del(v->env); }
                 lval_del(v->formals);
                 lval_del(v->body);
+                if (v->code) { lcode_del(v->code); }
             }
             break;
-            /* For Err or Sym free the string data */
+            /* For Err or Str free the string data */
         case LVAL_ERR:
             free(v->err);
             break;
-        case LVAL_SYM:
-            free(v->sym);
-            break;
         case LVAL_STR:
             free(v->str);
             break;
@@ -365,52 +581,147 @@ void lval_del(lval *v) {
                 lval_del(v->cell[i]);
             }
             /* Also free the memory allocated to contain the pointers */
-            free(v->cell);
+            slab_free(v->cell - v->offset, sizeof(lval *) * v->capacity);
             break;
     }
     /* Free the memory allocated for the "lval" struct itself */
-    free(v);
+    slab_free(v, lval_size(v));
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-    if (v->type == LVAL_SYM) {
-        lval *x = lenv_get(e, v);
-        lval_del(v);
-        return x;
-    }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
-    }
-    /* All other lval types remain the same */
-    return v;
-}
+/*
+ * Evaluate in a loop rather than recursing for calls in tail position, that
+ * is a lambda body, the branch taken by 'if' and the expression given to
+ * 'eval', so tail recursive functions run in constant C stack. When 'applied'
+ * is set v is an S-expression whose elements are already evaluated.
+ */
+static lval *lval_eval_loop(lenv *e, lval *v, int applied) {
+    // Frame entered by the last call, held while evaluation continues in it
+    lenv *frame = NULL;
+
+    while (1) {
+        if (!applied) {
+            if (v->type == LVAL_SYM) {
+                lval *x = lenv_get(e, v);
+                lval_del(v);
+                v = x;
+                break;
+            }
+            /* All other lval types remain the same */
+            if (v->type != LVAL_SEXPR) { break; }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-    /* Evaluate Children */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
+            /* A single expression evaluates to itself so carry on with it */
+            if (v->count == 1) {
+                v = lval_take(v, 0);
+                continue;
+            }
+            if (v->count == 0) { break; }
+
+            /* Look the head up first, special forms use the expression as it is */
+            lval *f = v->cell[0]->type == LVAL_SYM ? lenv_get(e, v->cell[0]) : NULL;
+            if (f && f->type == LVAL_FUN && f->builtin) {
+                int tail = 0;
+                lval *x = builtin_form(e, f, v, &tail);
+                if (x) {
+                    v = x;
+                    if (tail) { continue; }
+                    break;
+                }
+            }
 
-    /* Error checking */
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
-    }
+            /* Children are replaced in place so make sure nobody else sees it */
+            v = lval_own(v);
+
+            /* Evaluate Children */
+            for (int i = 0; i < v->count; i++) {
+                if (i == 0 && f) {
+                    lval_del(v->cell[0]);
+                    v->cell[0] = f;
+                } else {
+                    v->cell[i] = lval_eval(e, v->cell[i]);
+                }
+            }
+        }
+        applied = 0;
+
+        /* Error checking */
+        int error = -1;
+        for (int i = 0; i < v->count && error < 0; i++) {
+            if (v->cell[i]->type == LVAL_ERR) { error = i; }
+        }
+        if (error >= 0) {
+            v = lval_take(v, error);
+            break;
+        }
+
+        /* Ensure first element is a function */
+        lval *f = lval_pop(v, 0);
+        if (f->type != LVAL_FUN) {
+            lval_del(f);
+            lval_del(v);
+            v = lval_err("S-expression does not start with function!");
+            break;
+        }
+
+        /* 'if' and 'eval' hand back the expression to carry on with */
+        if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+            v = f->builtin == builtin_if ? builtin_if_branch(e, v) : builtin_eval_expr(e, v);
+            lval_del(f);
+            continue;
+        }
+
+        /* Call builtins to get result */
+        if (f->builtin) {
+            lval *result = f->builtin(e, v);
+            lval_del(f);
+            v = result;
+            break;
+        }
 
-    if (v->count == 0) { return v; }
-    if (v->count == 1) { return lval_take(v, 0); }
+        /* Errors and partially bound functions are the result */
+        lenv *x = NULL;
+        lval *r = lval_bind(e, f, v, &x);
+        if (r) {
+            lval_del(f);
+            v = r;
+            break;
+        }
+
+        /* Once the new frame shadows every name in its parent nothing can
+         * look the parent up through it any more, so it can be skipped */
+        while (x->parent->parent && lenv_covers(x, x->parent)) {
+            lenv *p = x->parent;
+            x->parent = p->parent;
+            x->parent->refs++;
+            lenv_del(p);
+        }
 
-    /* Ensure first element is a function */
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
+        /* Otherwise carry on with the body in the new frame, which keeps its parent alive */
+        if (frame) { lenv_del(frame); }
+        frame = x;
+        e = x;
+
+        /* Compiled bodies run in the VM and hand back any call in tail position */
+        if (f->code) {
+            lcode *code = f->code;
+            lval_del(f);
+            v = vm_run(code, e, &applied);
+            if (!applied) { break; }
+            continue;
+        }
+        v = lval_body(f);
         lval_del(f);
-        lval_del(v);
-        return lval_err("S-expression does not start with function!");
     }
 
-    /* Call function to get result */
-    lval *result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    if (frame) { lenv_del(frame); }
+    return v;
+}
+
+lval *lval_eval(lenv *e, lval *v) {
+    return lval_eval_loop(e, v, 0);
+}
+
+lval *lval_apply(lenv *e, lval *v) {
+    return lval_eval_loop(e, v, 1);
 }
 
 int lval_eq(lval *x, lval *y) {
@@ -424,7 +735,7 @@ int lval_eq(lval *x, lval *y) {
         case LVAL_ERR:
             return strcmp(x->err, y->err) == 0;
         case LVAL_SYM:
-            return strcmp(x->sym, y->sym) == 0;
+            return x->sym == y->sym;
         case LVAL_STR:
             return strcmp(x->str, y->str) == 0;
         case LVAL_FUN:
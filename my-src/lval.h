@@ -1,7 +1,11 @@
 #ifndef LVAL_H
 #define LVAL_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 #include "builtins.h"
+#include "lsym.h"
 
 enum {
     LVAL_NUM,
@@ -13,33 +17,74 @@ enum {
     LVAL_QEXPR
 };
 
+/*
+ * Values are a tagged union and are only allocated as large as their type
+ * needs, see lval_size. A number or symbol takes 16 bytes, a list 32.
+ */
 struct lval {
     int type;
 
-    // Basic
-    long num;
-    char *err;
-    char *sym;
-    char *str;
-
-    // Function
-    lbuiltin builtin;
-    lenv *env;
-    lval *formals;
-    lval *body;
-
-    // Expression
-    int count;
-    struct lval **cell;
+    // Number of references, values are shared and copied by lval_own before mutation
+    int refs;
+
+    union {
+        // Basic
+        long num;
+        char *err;
+        lsym *sym;
+        char *str;
+
+        // Function, only builtin is allocated for builtins, code is the body compiled for the VM
+        struct {
+            lbuiltin builtin;
+            lenv *env;
+            lval *formals;
+            lval *body;
+            lcode *code;
+        };
+
+        // Expression, cell points offset slots into an allocation of capacity slots
+        struct {
+            int count;
+            int capacity;
+            int offset;
+            struct lval **cell;
+        };
+    };
 };
 
+/*
+ * Growable buffer values are printed into. One with somewhere to go is
+ * written out in large chunks and when flushed, otherwise it just grows.
+ */
+typedef struct lbuf {
+    char *data;
+    size_t len;
+    size_t capacity;
+    FILE *out;
+} lbuf;
+
+extern lbuf lval_stdout;
+
+void lbuf_put(lbuf *b, char *s, size_t n);
+
+void lbuf_char(lbuf *b, char c);
+
+void lbuf_flush(lbuf *b);
+
 // Utils
 char *ltype_name(int t);
 
+void lval_write(lbuf *b, lval *v);
+
 void lval_print(lval *v);
 
 void lval_println(lval *v);
 
+void lval_cleanup();
+
+size_t lval_size(lval *v);
+
 // Constructors
 lval *lval_num(long x);
 
@@ -47,8 +92,14 @@ lval *lval_err(char *fmt, ...);
 
 lval *lval_sym(char *s);
 
+lval *lval_sym_len(char *s, size_t len);
+
+lval *lval_lsym(lsym *sym);
+
 lval *lval_str(char *s);
 
+lval *lval_str_len(char *s, size_t len);
+
 lval *lval_sexpr();
 
 lval *lval_qexpr();
@@ -62,20 +113,20 @@ lval *lval_add(lval *v, lval *x);
 
 lval *lval_copy(lval *v);
 
+lval *lval_own(lval *v);
+
 lval *lval_pop(lval *v, int i);
 
 lval *lval_take(lval *v, int i);
 
 lval *lval_join(lval *x, lval *y);
 
-lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_apply(lenv *e, lval *v);
 
 void lval_del(lval *v);
 
 lval *lval_eval(lenv *e, lval *v);
 
-lval *lval_eval_sexpr(lenv *e, lval *v);
-
 int lval_eq(lval *x, lval *y);
 
 #endif
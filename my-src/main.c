@@ -4,6 +4,10 @@
 #include "lval.h"
 #include "builtins.h"
 #include "parsing.h"
+#include "gc.h"
+#include "image.h"
+#include "slab.h"
+#include "vm.h"
 
 #ifdef _WIN32
 #include <string.h>
@@ -29,41 +33,87 @@ void add_history(char* unused) {}
 
 #endif
 
-mpc_parser_t *Lispy = NULL;
-
 int main(int argc, char **argv) {
+#ifdef LISPY_GC
+    gc_init(__builtin_frame_address(0));
+#endif
+
+    // pick out options, anything else is a file to load
+    int show_stats = 0;
+    char *image = NULL;
+    char *save_image = NULL;
+    int files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--engine=tree") == 0) {
+            lispy_engine = ENGINE_TREE;
+        } else if (strcmp(argv[i], "--engine=vm") == 0) {
+            lispy_engine = ENGINE_VM;
+        } else if (strcmp(argv[i], "--reader=mpc") == 0) {
+            lispy_reader = READER_MPC;
+        } else if (strcmp(argv[i], "--reader=direct") == 0) {
+            lispy_reader = READER_DIRECT;
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image = argv[i] + 8;
+        } else if (strncmp(argv[i], "--save-image=", 13) == 0) {
+            save_image = argv[i] + 13;
+        } else {
+            argv[++files] = argv[i];
+        }
+    }
 
-    /* Create some parsers */
-    mpc_parser_t *Number = mpc_new("number");
-    mpc_parser_t *Symbol = mpc_new("symbol");
-    mpc_parser_t *String = mpc_new("string");
-    mpc_parser_t *Comment = mpc_new("comment");
-    mpc_parser_t *Sexpr = mpc_new("sexpr");
-    mpc_parser_t *Qexpr = mpc_new("qexpr");
-    mpc_parser_t *Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
-
-    /* Define them with the following Language */
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "                                         \
-                number: /-?[0-9]+/ ;                            \
-                symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;      \
-                string: /\"(\\\\.|[^\"])*\"/ ;                  \
-                comment : /;[^\\r\\n]*/ ;                       \
-                sexpr: '(' <expr>* ')' ;                        \
-                qexpr: '{' <expr>* '}' ;                        \
-                expr: <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; \
-                lispy: /^/ <expr>* /$/ ;                        \
-            ",
-              Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    /* The grammar is only needed when reading with mpc */
+    mpc_parser_t *Number = NULL, *Symbol = NULL, *String = NULL, *Comment = NULL;
+    mpc_parser_t *Sexpr = NULL, *Qexpr = NULL, *Expr = NULL;
+    if (lispy_reader == READER_MPC) {
+        /* Create some parsers */
+        Number = mpc_new("number");
+        Symbol = mpc_new("symbol");
+        String = mpc_new("string");
+        Comment = mpc_new("comment");
+        Sexpr = mpc_new("sexpr");
+        Qexpr = mpc_new("qexpr");
+        Expr = mpc_new("expr");
+        Lispy = mpc_new("lispy");
+
+        /* Define them with the following Language */
+        mpca_lang(MPCA_LANG_DEFAULT,
+                  "                                         \
+                    number: /-?[0-9]+/ ;                            \
+                    symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;      \
+                    string: /\"(\\\\.|[^\"])*\"/ ;                  \
+                    comment : /;[^\\r\\n]*/ ;                       \
+                    sexpr: '(' <expr>* ')' ;                        \
+                    qexpr: '{' <expr>* '}' ;                        \
+                    expr: <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; \
+                    lispy: /^/ <expr>* /$/ ;                        \
+                ",
+                  Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    }
 
     lenv *e = lenv_new();
-    lenv_add_builtins(e);
+#ifdef LISPY_GC
+    gc_root(e);
+#endif
+
+    // start from a saved image when given one, it holds the builtins along with everything else
+    if (image) {
+        lval *x = image_load(e, image);
+        // fall back to just the builtins if it can't be used
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
+            lenv_add_builtins(e);
+        }
+        lval_del(x);
+    } else {
+        lenv_add_builtins(e);
+    }
 
-    // supplied with a list of arguments
-    if (argc >= 2) {
+    // supplied with a list of arguments, "-" is standard input
+    if (files >= 1) {
         // loop over each supplied filename (starting from 1)
-        for (int i = 1; i < argc; i++) {
+        for (int i = 1; i <= files; i++) {
             // argument list with a single argument, the filename
             lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
             // pass to builtin load and get the result
@@ -73,12 +123,15 @@ int main(int argc, char **argv) {
             if (x->type == LVAL_ERR) { lval_println(x); }
             lval_del(x);
         }
-    } else if (argc == 1) {
+    } else {
 
         /* Print Version and Exit information */
         puts("Lispy Version 0.0.0.0.1");
         puts("Press Ctrl+c or type 'exit' to Exit\n");
 
+        /* Parse every line in the same context rather than setting one up each time */
+        mpc_context_t *context = lispy_reader == READER_MPC ? mpc_context_new() : NULL;
+
         /* In a never ending loop */
         while (1) {
 
@@ -92,26 +145,41 @@ int main(int argc, char **argv) {
             /* Add input to history */
             add_history(input);
 
-            /* Attempt to parse the user input */
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lispy, &r)) {
-                lval *x = lval_eval(e, lval_read(r.output));
-                lval_println(x);
-                lval_del(x);
-            } else {
-                /* Otherwise print the error */
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
-            }
+            /* Attempt to parse the user input, printing the error if it fails */
+            lval *x = lval_read_line(context, input);
+            if (x->type != LVAL_ERR) { x = lval_eval(e, x); }
+            lval_println(x);
+            lval_del(x);
 
             /* Free retrieved input */
             free(input);
         }
+
+        if (context) { mpc_context_delete(context); }
+    }
+
+    if (save_image) {
+        lval *x = image_save(e, save_image);
+        if (x->type == LVAL_ERR) { lval_println(x); }
+        lval_del(x);
+    }
+
+    if (show_stats) {
+        slab_stats stats = slab_get_stats();
+        fprintf(stderr, "live objects: %li\nlive bytes: %li\nhigh water bytes: %li\nslab bytes: %li\n",
+                stats.live_objects, stats.live_bytes, stats.high_water_bytes, stats.slab_bytes);
     }
 
     /* Undefine and Delete our Parsers and environment */
-    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    if (Lispy) { mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy); }
     lenv_del(e);
+#ifdef LISPY_GC
+    gc_cleanup();
+#endif
+    vm_cleanup();
+    lval_cleanup();
+    lsym_cleanup();
+    slab_cleanup();
 
     return 0;
 }
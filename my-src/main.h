@@ -3,6 +3,6 @@
 
 #include "mpc.h"
 
-mpc_parser_t *Lispy;
+extern mpc_parser_t *Lispy;
 
 #endif
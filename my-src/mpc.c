@@ -35,10 +35,11 @@ static mpc_state_t mpc_state_new(void) {
 ** The cursor can jump around at will making
 ** backtracking easy.
 **
-** The second is a File which is also somewhat
-** easy. The contents are never loaded into
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** The second is a File which is also easy. The
+** rest of the file is read into memory in large
+** blocks up front and from then on it is just
+** a String, so peeking and backtracking never
+** have to seek in the file.
 **
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and
@@ -59,12 +60,12 @@ static mpc_state_t mpc_state_new(void) {
 
 enum {
   MPC_INPUT_STRING = 0,
-  MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 1
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_READ_MIN  = 65536
 };
 
 enum {
@@ -75,6 +76,34 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+enum {
+  MPC_INPUT_MEMO_NUM = 1024
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  mpc_state_t state;
+  mpc_state_t end;
+  char last;
+  char end_last;
+  char backtrack;
+  char suppress;
+  char ok;
+  mpc_val_t *x;
+  mpc_dtor_t dx;
+  mpc_err_t *error;
+  mpc_err_t *errors;
+} mpc_memo_t;
+
+typedef struct {
+  mpc_parser_t *p;
+  long results;
+  int j;
+  mpc_state_t state;
+  char last;
+  mpc_err_t *errors;
+} mpc_frame_t;
+
 typedef struct {
 
   int type;
@@ -83,10 +112,14 @@ typedef struct {
 
   char *string;
   char *buffer;
+  long buffer_pos;
+  long buffer_num;
+  long buffer_slots;
   FILE *file;
 
   int suppress;
   int backtrack;
+  int compiled;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -94,29 +127,48 @@ typedef struct {
   char *lasts;
   char last;
 
+  mpc_memo_t *memo;
+
+  mpc_frame_t *frames;
+  long frames_num;
+  long frames_slots;
+
+  mpc_result_t *results;
+  long results_num;
+  long results_slots;
+
   size_t mem_index;
+  size_t mem_used;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new(int type) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
-
+  i->filename = NULL;
+  i->type = type;
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = NULL;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->compiled = 0;
+  i->memo = NULL;
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
+  i->results = NULL;
+  i->results_num = 0;
+  i->results_slots = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
@@ -124,37 +176,35 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_STRING);
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
 
-  i->state = mpc_state_new();
+  i->string = malloc(strlen(string) + 1);
+  strcpy(i->string, string);
+
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_STRING);
+
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
 
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
-  i->file = NULL;
-
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
   return i;
 
@@ -162,67 +212,85 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_PIPE);
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
 
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
-
-  i->string = NULL;
-  i->buffer = NULL;
   i->file = pipe;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
   return i;
 
 }
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  size_t n = 0, k, slots = MPC_INPUT_READ_MIN;
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_STRING);
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
 
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = file;
+  i->string = malloc(slots + 1);
+  while ((k = fread(i->string + n, 1, slots - n, file)) > 0) {
+    n += k;
+    if (n == slots) {
+      slots *= 2;
+      i->string = realloc(i->string, slots + 1);
+    }
+  }
+  i->string[n] = '\0';
+
+  return i;
+}
+
+/*
+** Make an input read `string` in place, ready to
+** parse from the start. A context's input goes
+** through this for every parse, and keeps what it
+** has allocated from the parse before.
+*/
+
+static void mpc_input_reset(mpc_input_t *i, const char *filename, const char *string) {
+
+  i->filename = (char*)filename;
+  i->type = MPC_INPUT_STRING;
+  i->state = mpc_state_new();
+  i->string = (char*)string;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->compiled = 0;
+  i->frames_num = 0;
+  i->results_num = 0;
   i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
   i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-
-  return i;
+  if (i->mem_used) {
+    i->mem_used = 0;
+    memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  }
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
 
+  long j;
+
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
+  /* Give input read ahead of the cursor back to the pipe */
+  if (i->type == MPC_INPUT_PIPE) {
+    for (j = i->buffer_pos + i->buffer_num - 1; j >= i->state.pos; j--) {
+      ungetc(i->buffer[j - i->buffer_pos], i->file);
+    }
+    free(i->buffer);
+  }
+
+  free(i->frames);
+  free(i->results);
   free(i->marks);
   free(i->lasts);
   free(i);
@@ -238,13 +306,15 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
   size_t j;
   char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  /* A full pool is common with deep nesting, so don't search it */
+  if (n > sizeof(mpc_mem_t) || i->mem_used == MPC_INPUT_MEM_NUM) { return malloc(n); }
 
   j = i->mem_index;
   do {
     if (!i->mem_full[i->mem_index]) {
       p = (void*)(i->mem + i->mem_index);
       i->mem_full[i->mem_index] = 1;
+      i->mem_used++;
       i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
       return p;
     }
@@ -265,6 +335,7 @@ static void mpc_free(mpc_input_t *i, void *p) {
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
   i->mem_full[j] = 0;
+  i->mem_used--;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -313,14 +384,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,14 +401,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -352,115 +410,65 @@ static void mpc_input_rewind(mpc_input_t *i) {
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
 
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
-}
+/*
+** Pipe input is kept in a buffer which starts
+** at the earliest position a rewind can return
+** to. Characters are read into it as they are
+** peeked at, so nothing is pushed back, and the
+** input behind the cursor is dropped whenever
+** there are no marks left.
+*/
 
-static char mpc_input_getc(mpc_input_t *i) {
+static int mpc_input_buffer_fill(mpc_input_t *i) {
 
-  char c = '\0';
+  int c;
 
-  switch (i->type) {
+  if (i->state.pos < i->buffer_pos + i->buffer_num) { return 1; }
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
+  if (i->marks_num == 0) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_num = 0;
+  }
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+  c = getc(i->file);
+  if (c == EOF) { return 0; }
 
-    default: return c;
+  if (i->buffer_num == i->buffer_slots) {
+    i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : MPC_INPUT_READ_MIN;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
   }
-}
 
-static char mpc_input_peekc(mpc_input_t *i) {
+  i->buffer[i->buffer_num++] = c;
+  return 1;
+}
 
-  char c = '\0';
+static char mpc_input_getc(mpc_input_t *i) {
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE:
-
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
-
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
 
+    case MPC_INPUT_STRING: return i->string[i->state.pos];
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+      if (!mpc_input_buffer_fill(i)) { return '\0'; }
+      return i->buffer[i->state.pos - i->buffer_pos];
 
-    default: return c;
+    default: return '\0';
   }
+}
 
+static char mpc_input_peekc(mpc_input_t *i) {
+  return mpc_input_getc(i);
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
   return mpc_input_peekc(i) == '\0';
 }
 
-static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
-    default: { break; }
-  }
-  return 0;
-}
-
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -490,35 +498,35 @@ static int mpc_input_char(mpc_input_t *i, char c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return x == c ? mpc_input_success(i, x, o) : 0;
 }
 
 static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return x >= c && x <= d ? mpc_input_success(i, x, o) : 0;
 }
 
 static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : 0;
 }
 
 static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : 0;
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return cond(x) ? mpc_input_success(i, x, o) : 0;
 }
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
@@ -568,6 +576,207 @@ static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   return r;
 }
 
+/*
+** Compiled Regular Expressions
+**
+** A regex is built out of the same combinators
+** as any other parser, so matching one costs a
+** trip through `mpc_parse_run` for every node
+** and a mark for every sequence.
+**
+** Where the tree only uses the combinators a
+** regex is made from it is also compiled into a
+** small backtracking program. Characters are
+** tested against 256 entry byte class tables,
+** runs of a class are consumed in a tight loop,
+** and a failed branch jumps back to the last
+** choice point instead of unwinding the stack.
+**
+** The program keeps the semantics of the tree.
+** Repetition is greedy and never gives back,
+** choice is ordered, and a failure consumes no
+** input. That rules out a DFA, which would find
+** the longest match instead of the first one.
+*/
+
+enum {
+  MPC_RE_OP_CHAR,
+  MPC_RE_OP_SET,
+  MPC_RE_OP_SPAN,
+  MPC_RE_OP_ANCHOR,
+  MPC_RE_OP_SOI,
+  MPC_RE_OP_EOI,
+  MPC_RE_OP_CHOICE,
+  MPC_RE_OP_COMMIT,
+  MPC_RE_OP_FAILTWICE,
+  MPC_RE_OP_MATCH
+};
+
+enum {
+  MPC_RE_STACK_MIN = 32
+};
+
+typedef struct {
+  int op;
+  int x;
+  int(*f)(char,char);
+} mpc_re_inst_t;
+
+typedef struct {
+  int code_num;
+  mpc_re_inst_t *code;
+  int sets_num;
+  unsigned char (*sets)[256];
+} mpc_re_prog_t;
+
+typedef struct {
+  int pc;
+  int term;
+  long pos;
+} mpc_re_choice_t;
+
+/*
+** Run a program on the string `s` from `pos`. On
+** success `end` is where the match finished and
+** `term` whether end of input was matched.
+*/
+
+static int mpc_re_match(const mpc_re_prog_t *g, const char *s, long pos, char last, int *term, long *end) {
+
+  mpc_re_choice_t stk[MPC_RE_STACK_MIN];
+  mpc_re_choice_t *choices = stk;
+  int slots = MPC_RE_STACK_MIN;
+  int n = 0, pc = 0, t = *term;
+  long start = pos;
+  const mpc_re_inst_t *in;
+  const unsigned char *set;
+
+  while (1) {
+
+    in = &g->code[pc];
+
+    switch (in->op) {
+
+      case MPC_RE_OP_CHAR:
+        if (s[pos] != (char)in->x) { goto fail; }
+        pos++; pc++;
+        continue;
+
+      case MPC_RE_OP_SET:
+        if (!g->sets[in->x][(unsigned char)s[pos]]) { goto fail; }
+        pos++; pc++;
+        continue;
+
+      case MPC_RE_OP_SPAN:
+        set = g->sets[in->x];
+        while (set[(unsigned char)s[pos]]) { pos++; }
+        pc++;
+        continue;
+
+      case MPC_RE_OP_ANCHOR:
+        if (!in->f(pos > start ? s[pos-1] : last, s[pos])) { goto fail; }
+        pc++;
+        continue;
+
+      case MPC_RE_OP_SOI:
+        if (pos > start || last != '\0') { goto fail; }
+        pc++;
+        continue;
+
+      case MPC_RE_OP_EOI:
+        if (t || s[pos] != '\0') { goto fail; }
+        t = 1; pc++;
+        continue;
+
+      case MPC_RE_OP_CHOICE:
+        if (n == slots) {
+          slots = n + n / 2;
+          if (choices == stk) {
+            choices = malloc(sizeof(mpc_re_choice_t) * slots);
+            memcpy(choices, stk, sizeof(mpc_re_choice_t) * n);
+          } else {
+            choices = realloc(choices, sizeof(mpc_re_choice_t) * slots);
+          }
+        }
+        choices[n].pc = in->x;
+        choices[n].term = t;
+        choices[n].pos = pos;
+        n++; pc++;
+        continue;
+
+      case MPC_RE_OP_COMMIT:
+        n--; pc = in->x;
+        continue;
+
+      case MPC_RE_OP_FAILTWICE:
+        n--;
+        goto fail;
+
+      case MPC_RE_OP_MATCH:
+        if (choices != stk) { free(choices); }
+        *term = t;
+        *end = pos;
+        return 1;
+    }
+
+  fail:
+    if (n == 0) {
+      if (choices != stk) { free(choices); }
+      return 0;
+    }
+    n--;
+    pc = choices[n].pc;
+    t = choices[n].term;
+    pos = choices[n].pos;
+  }
+
+}
+
+static int mpc_input_regex(mpc_input_t *i, const mpc_re_prog_t *g, char **o) {
+
+  long j, end;
+  int term = i->state.term;
+  const char *s = i->string;
+
+  if (!mpc_re_match(g, s, i->state.pos, i->last, &term, &end)) { return 0; }
+
+  *o = mpc_malloc(i, end - i->state.pos + 1);
+  memcpy(*o, s + i->state.pos, end - i->state.pos);
+  (*o)[end - i->state.pos] = '\0';
+
+  for (j = i->state.pos; j < end; j++) {
+    i->state.col++;
+    if (s[j] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+
+  if (end > i->state.pos) { i->last = s[end-1]; }
+  i->state.pos = end;
+  i->state.term = term;
+  return 1;
+}
+
+static void mpc_re_prog_delete(mpc_re_prog_t *g) {
+  free(g->code);
+  free(g->sets);
+  free(g);
+}
+
+static mpc_re_prog_t *mpc_re_prog_copy(const mpc_re_prog_t *a) {
+  mpc_re_prog_t *g = malloc(sizeof(mpc_re_prog_t));
+  memcpy(g, a, sizeof(mpc_re_prog_t));
+  g->code = malloc(sizeof(mpc_re_inst_t) * a->code_num);
+  memcpy(g->code, a->code, sizeof(mpc_re_inst_t) * a->code_num);
+  g->sets = NULL;
+  if (a->sets_num) {
+    g->sets = malloc(256 * a->sets_num);
+    memcpy(g->sets, a->sets, 256 * a->sets_num);
+  }
+  return g;
+}
+
 /*
 ** Error Type
 */
@@ -869,6 +1078,29 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   return y;
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? mpc_malloc(i, sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->received = x->received;
+  return y;
+}
+
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   mpc_err_t *errs[2];
   errs[0] = x;
@@ -914,7 +1146,10 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_REGEX      = 29,
+  MPC_TYPE_MEMO       = 30
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -934,6 +1169,8 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_re_prog_t *g; } mpc_pdata_regex_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t cx; mpc_dtor_t dx; long lookups; long hits; } mpc_pdata_memo_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -953,6 +1190,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_regex_t regex;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -1033,282 +1272,443 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
 }
 
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_PARSE_FRAMES_MIN  = 64,
+  MPC_PARSE_RESULTS_MIN = 64
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** Memoization
+**
+** Results of a parser made with `mpc_memo` are
+** kept in a table in the input keyed by parser
+** and position, so backtracking into the same
+** rule at the same place does not parse it all
+** over again. The table has a fixed number of
+** slots and a new result replaces whatever was
+** in its slot, which bounds the memory used.
+**
+** Along with the result each entry keeps the
+** errors the parser merged on the way to it, so
+** a hit reports exactly what a re-parse would.
+*/
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+static mpc_memo_t *mpc_input_memo(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h = ((size_t)p / sizeof(mpc_parser_t)) * 31 + (size_t)pos;
+  if (!i->memo) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  return &i->memo[(h ^ (h >> 10)) % MPC_INPUT_MEMO_NUM];
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static void mpc_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->ok && m->dx) { m->dx(m->x); }
+  mpc_err_delete_internal(i, m->error);
+  mpc_err_delete_internal(i, m->errors);
+  m->p = NULL;
+  m->ok = 0;
+  m->x = NULL;
+  m->error = NULL;
+  m->errors = NULL;
+}
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+static void mpc_input_memo_delete(mpc_input_t *i) {
+  int j;
+  if (!i->memo) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(i, &i->memo[j]); }
+  free(i->memo);
+  i->memo = NULL;
+}
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
-  }
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p) {
 
-  switch (p->type) {
+  mpc_memo_t *m = mpc_input_memo(i, p, i->state.pos);
 
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
-
-    /* Other parsers */
-
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
-
-    /* Application Parsers */
-
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+  p->data.memo.lookups++;
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  if (m->p == p
+  &&  m->state.pos == i->state.pos
+  &&  m->state.term == i->state.term
+  &&  m->last == i->last
+  &&  m->backtrack == (i->backtrack > 0)
+  &&  m->suppress == (i->suppress > 0)) {
+    p->data.memo.hits++;
+    return m;
+  }
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  return NULL;
+}
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+static void mpc_memo_store(mpc_input_t *i, mpc_parser_t *p, mpc_frame_t *f, int x, mpc_result_t *r, mpc_err_t *e) {
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  mpc_memo_t *m;
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+  if (x && !p->data.memo.cx) { return; }
 
-    /* Optional Parsers */
+  m = mpc_input_memo(i, p, f->state.pos);
+  mpc_memo_clear(i, m);
+  m->p = p;
+  m->state = f->state;
+  m->last = f->last;
+  m->backtrack = i->backtrack > 0;
+  m->suppress = i->suppress > 0;
+  m->ok = x;
+  m->end = i->state;
+  m->end_last = i->last;
+  m->x = x ? p->data.memo.cx(r->output) : NULL;
+  m->dx = p->data.memo.dx;
+  m->error = x ? NULL : mpc_err_copy(i, r->error);
+  m->errors = mpc_err_copy(i, e);
+}
 
-    /* TODO: Update Not Error Message */
+/*
+** The parse runs on a stack of frames kept in
+** the input rather than on the C stack, so how
+** deeply the input nests is only limited by the
+** memory available. Entering a combinator pushes
+** a frame and moves on to its first child. When
+** a parser finishes, its result is handed to the
+** frame on top, which either starts another
+** child or is popped and finishes in turn.
+**
+** Outputs collected by sequences and repeats go
+** on a second stack. A frame's outputs are on
+** top of it whenever the frame is on top, so
+** appending to them never disturbs another's.
+*/
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+static mpc_frame_t *mpc_parse_push(mpc_input_t *i, mpc_parser_t *p) {
+  mpc_frame_t *f;
+  if (i->frames_num == i->frames_slots) {
+    i->frames_slots = i->frames_slots ? i->frames_slots * 2 : MPC_PARSE_FRAMES_MIN;
+    i->frames = realloc(i->frames, sizeof(mpc_frame_t) * i->frames_slots);
+  }
+  f = &i->frames[i->frames_num++];
+  f->p = p;
+  f->j = 0;
+  f->results = i->results_num;
+  return f;
+}
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+static void mpc_parse_pop(mpc_input_t *i) {
+  i->frames_num--;
+  i->results_num = i->frames[i->frames_num].results;
+}
 
-    /* Repeat Parsers */
+static long mpc_parse_push_result(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r) {
+  if (i->results_num == i->results_slots) {
+    i->results_slots = i->results_slots ? i->results_slots * 2 : MPC_PARSE_RESULTS_MIN;
+    i->results = realloc(i->results, sizeof(mpc_result_t) * i->results_slots);
+  }
+  i->results[i->results_num++] = *r;
+  return i->results_num - f->results;
+}
 
-    case MPC_TYPE_MANY:
+#define MPC_SUCCESS(v) { r->output = v; x = 1; p = NULL; break; }
+#define MPC_FAILURE(v) { r->error = v; x = 0; p = NULL; break; }
+#define MPC_PRIMITIVE(c) \
+  if (c) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
+#define MPC_RESULTS(f) ((mpc_val_t**)&i->results[(f)->results])
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+  int x = 0;
+  long j, k, base = i->frames_num;
+  mpc_frame_t *f;
+  mpc_parser_t *q;
+  mpc_memo_t *m;
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  while (1) {
 
-    case MPC_TYPE_MANY1:
+    /* Enter `p` until it finishes or hands over to a child */
+    while (p) {
+
+      switch (p->type) {
+
+        /* Basic Parsers */
+
+        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
+        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
+        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+
+        /* Other parsers */
+
+        case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+        case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+        case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+        /* Application Parsers */
+
+        case MPC_TYPE_APPLY:      mpc_parse_push(i, p); p = p->data.apply.x; break;
+        case MPC_TYPE_APPLY_TO:   mpc_parse_push(i, p); p = p->data.apply_to.x; break;
+        case MPC_TYPE_CHECK:      mpc_parse_push(i, p); p = p->data.check.x; break;
+        case MPC_TYPE_CHECK_WITH: mpc_parse_push(i, p); p = p->data.check_with.x; break;
+
+        case MPC_TYPE_EXPECT:
+          mpc_input_suppress_enable(i);
+          mpc_parse_push(i, p);
+          p = p->data.expect.x;
+          break;
+
+        case MPC_TYPE_PREDICT:
+          mpc_input_backtrack_disable(i);
+          mpc_parse_push(i, p);
+          p = p->data.predict.x;
+          break;
+
+        /* Optional Parsers */
+
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          mpc_parse_push(i, p);
+          p = p->data.not.x;
+          break;
+
+        case MPC_TYPE_MAYBE: mpc_parse_push(i, p); p = p->data.not.x; break;
+
+        /* Repeat Parsers */
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+          mpc_parse_push(i, p);
+          p = p->data.repeat.x;
+          break;
+
+        /* Combinatory Parsers */
+
+        case MPC_TYPE_OR:
+          if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+          mpc_parse_push(i, p);
+          p = p->data.or.xs[0];
+          break;
+
+        case MPC_TYPE_AND:
+          if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          mpc_input_mark(i);
+          mpc_parse_push(i, p);
+          p = p->data.and.xs[0];
+          break;
+
+        /* Regular Expressions */
+
+        case MPC_TYPE_REGEX:
+          if (i->compiled && i->type == MPC_INPUT_STRING && i->backtrack > 0) {
+            MPC_PRIMITIVE(mpc_input_regex(i, p->data.regex.g, (char**)&r->output));
+          }
+          p = p->data.regex.x;
+          break;
+
+        /* Memoization */
+
+        case MPC_TYPE_MEMO:
+          m = mpc_memo_find(i, p);
+          if (m) {
+            i->state = m->end;
+            i->last = m->end_last;
+            if (m->errors) { *e = mpc_err_merge(i, *e, mpc_err_copy(i, m->errors)); }
+            if (m->ok) { MPC_SUCCESS(p->data.memo.cx(m->x)); }
+            else       { MPC_FAILURE(mpc_err_copy(i, m->error)); }
+          }
+          f = mpc_parse_push(i, p);
+          f->state = i->state;
+          f->last = i->last;
+          f->errors = *e;
+          *e = NULL;
+          p = p->data.memo.x;
+          break;
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
+        /* End */
+
+        default:
+
+          MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
       }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+    }
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+    /* Hand the result `x` in `r` to the frame on top */
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+    if (i->frames_num == base) { return x; }
 
-    case MPC_TYPE_COUNT:
+    f = &i->frames[i->frames_num-1];
+    q = f->p;
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+    switch (q->type) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+      case MPC_TYPE_APPLY:
+        mpc_parse_pop(i);
+        if (x) { r->output = mpc_parse_apply(i, q->data.apply.f, r->output); }
+        break;
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      case MPC_TYPE_APPLY_TO:
+        mpc_parse_pop(i);
+        if (x) { r->output = mpc_parse_apply_to(i, q->data.apply_to.f, r->output, q->data.apply_to.d); }
+        break;
+
+      case MPC_TYPE_CHECK:
+        mpc_parse_pop(i);
+        if (x && !q->data.check.f(&r->output)) {
+          mpc_parse_dtor(i, q->data.check.dx, r->output);
+          MPC_FAILURE(mpc_err_fail(i, q->data.check.e));
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+        break;
 
-    /* Combinatory Parsers */
+      case MPC_TYPE_CHECK_WITH:
+        mpc_parse_pop(i);
+        if (x && !q->data.check_with.f(&r->output, q->data.check_with.d)) {
+          mpc_parse_dtor(i, q->data.check_with.dx, r->output);
+          MPC_FAILURE(mpc_err_fail(i, q->data.check_with.e));
+        }
+        break;
 
-    case MPC_TYPE_OR:
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        mpc_parse_pop(i);
+        if (!x) { MPC_FAILURE(mpc_err_new(i, q->data.expect.m)); }
+        break;
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      case MPC_TYPE_PREDICT:
+        mpc_input_backtrack_enable(i);
+        mpc_parse_pop(i);
+        break;
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      /* TODO: Update Not Error Message */
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      case MPC_TYPE_NOT:
+        mpc_parse_pop(i);
+        if (x) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, q->data.not.dx, r->output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+          mpc_input_unmark(i);
+          mpc_input_suppress_disable(i);
+          MPC_SUCCESS(q->data.not.lf());
         }
-      }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
-    case MPC_TYPE_AND:
+      case MPC_TYPE_MAYBE:
+        mpc_parse_pop(i);
+        if (!x) {
+          *e = mpc_err_merge(i, *e, r->error);
+          MPC_SUCCESS(q->data.not.lf());
+        }
+        break;
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (x) {
+          mpc_parse_push_result(i, f, r);
+          p = q->data.repeat.x;
+          break;
+        }
+        j = i->results_num - f->results;
+        if (j == 0 && q->type == MPC_TYPE_MANY1) {
+          mpc_parse_pop(i);
+          MPC_FAILURE(mpc_err_many1(i, r->error));
+        }
+        *e = mpc_err_merge(i, *e, r->error);
+        r->output = mpc_parse_fold(i, q->data.repeat.f, j, MPC_RESULTS(f));
+        mpc_parse_pop(i);
+        x = 1;
+        break;
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      case MPC_TYPE_COUNT:
+        if (x) {
+          j = mpc_parse_push_result(i, f, r);
+          if (j < q->data.repeat.n) { p = q->data.repeat.x; break; }
+          r->output = mpc_parse_fold(i, q->data.repeat.f, j, MPC_RESULTS(f));
+          mpc_parse_pop(i);
+          break;
+        }
+        for (k = f->results; k < i->results_num; k++) {
+          mpc_parse_dtor(i, q->data.repeat.dx, i->results[k].output);
+        }
+        mpc_parse_pop(i);
+        MPC_FAILURE(mpc_err_count(i, r->error, q->data.repeat.n));
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      case MPC_TYPE_OR:
+        if (x) { mpc_parse_pop(i); break; }
+        *e = mpc_err_merge(i, *e, r->error);
+        if (++f->j < q->data.or.n) { p = q->data.or.xs[f->j]; break; }
+        mpc_parse_pop(i);
+        MPC_FAILURE(NULL);
+
+      case MPC_TYPE_AND:
+        if (x) {
+          j = mpc_parse_push_result(i, f, r);
+          if (j < q->data.and.n) { p = q->data.and.xs[j]; break; }
+          mpc_input_unmark(i);
+          r->output = mpc_parse_fold(i, q->data.and.f, j, MPC_RESULTS(f));
+          mpc_parse_pop(i);
+          break;
         }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        mpc_input_rewind(i);
+        for (k = f->results; k < i->results_num; k++) {
+          mpc_parse_dtor(i, q->data.and.dxs[k - f->results], i->results[k].output);
+        }
+        mpc_parse_pop(i);
+        break;
 
-    /* End */
+      case MPC_TYPE_MEMO:
+        mpc_memo_store(i, q, f, x, r, *e);
+        if (f->errors) { *e = *e ? mpc_err_merge(i, f->errors, *e) : f->errors; }
+        mpc_parse_pop(i);
+        break;
 
-    default:
+      default: break;
+    }
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
   }
 
-  return 0;
-
 }
 
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
+#undef MPC_RESULTS
+
+/*
+** Parsing is done in two passes. The first runs
+** compiled regular expressions and builds no
+** errors, which is all a successful parse needs.
+** Only when it fails is the input parsed again
+** through the full trees to find out why.
+*/
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_err_t *e = NULL;
+
+  mpc_input_mark(i);
+  i->compiled = 1;
+  mpc_input_suppress_enable(i);
+  x = mpc_parse_run(i, p, r, &e);
+  mpc_input_suppress_disable(i);
+  i->compiled = 0;
+  mpc_input_memo_delete(i);
+  mpc_err_delete_internal(i, e);
+  if (x) {
+    mpc_input_unmark(i);
+    r->output = mpc_export(i, r->output);
+    return x;
+  }
+  mpc_input_rewind(i);
+
+  e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  x = mpc_parse_run(i, p, r, &e);
+  mpc_input_memo_delete(i);
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1336,8 +1736,10 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
 
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  long start = ftell(file);
   mpc_input_t *i = mpc_input_new_file(filename, file);
   x = mpc_parse_input(i, p, r);
+  if (start >= 0) { fseek(file, start + i->state.pos, SEEK_SET); }
   mpc_input_delete(i);
   return x;
 }
@@ -1350,6 +1752,36 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+/*
+** Parse Contexts
+*/
+
+struct mpc_context_t {
+  mpc_input_t *input;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input = mpc_input_new(MPC_INPUT_STRING);
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  c->input->filename = NULL;
+  c->input->string = NULL;
+  mpc_input_delete(c->input);
+  free(c);
+}
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_reset(c->input, filename, string);
+  x = mpc_parse_input(c->input, p, r);
+  c->input->filename = NULL;
+  c->input->string = NULL;
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
@@ -1440,6 +1872,13 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_REGEX:
+      mpc_undefine_unretained(p->data.regex.x, 0);
+      mpc_re_prog_delete(p->data.regex.g);
+      break;
+
+    case MPC_TYPE_MEMO: mpc_undefine_unretained(p->data.memo.x, 0); break;
+
     default: break;
   }
 
@@ -1564,6 +2003,17 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_REGEX:
+      p->data.regex.x = mpc_copy(a->data.regex.x);
+      p->data.regex.g = mpc_re_prog_copy(a->data.regex.g);
+      break;
+
+    case MPC_TYPE_MEMO:
+      p->data.memo.x = mpc_copy(a->data.memo.x);
+      p->data.memo.lookups = 0;
+      p->data.memo.hits = 0;
+      break;
+
     default: break;
   }
 
@@ -1874,6 +2324,17 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t ca, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.cx = ca;
+  p->data.memo.dx = da;
+  p->data.memo.lookups = 0;
+  p->data.memo.hits = 0;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2354,6 +2815,321 @@ mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
 
+/*
+** Regex Compiler
+**
+** Compiles the tree built for a regex into the
+** program run by `mpc_re_match`. A tree which
+** uses anything the program cannot express, or
+** repeats something that can match nothing, is
+** left as it is.
+*/
+
+enum {
+  MPC_RE_COUNT_MAX = 64
+};
+
+static int mpc_re_emit(mpc_re_prog_t *g, int op, int x) {
+  g->code = realloc(g->code, sizeof(mpc_re_inst_t) * (g->code_num + 1));
+  g->code[g->code_num].op = op;
+  g->code[g->code_num].x = x;
+  g->code[g->code_num].f = NULL;
+  return g->code_num++;
+}
+
+/* Whether `p` always consumes exactly one byte, and if so which ones in `set` */
+static int mpc_re_class(mpc_parser_t *p, unsigned char *set) {
+
+  int c, j;
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+      for (c = 1; c < 256; c++) { set[c] = 1; }
+      return 1;
+
+    case MPC_TYPE_SINGLE:
+      if (p->data.single.x == '\0') { return 0; }
+      set[(unsigned char)p->data.single.x] = 1;
+      return 1;
+
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { set[c] = 1; }
+      }
+      return 1;
+
+    case MPC_TYPE_ONEOF:
+      for (c = 1; c < 256; c++) {
+        if (strchr(p->data.string.x, (char)c) != 0) { set[c] = 1; }
+      }
+      return 1;
+
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if (strchr(p->data.string.x, (char)c) == 0) { set[c] = 1; }
+      }
+      return 1;
+
+    case MPC_TYPE_SATISFY:
+      for (c = 1; c < 256; c++) {
+        if (p->data.satisfy.f((char)c)) { set[c] = 1; }
+      }
+      return 1;
+
+    case MPC_TYPE_EXPECT: return mpc_re_class(p->data.expect.x, set);
+
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_re_class(p->data.or.xs[j], set)) { return 0; }
+      }
+      return 1;
+
+    default: return 0;
+  }
+
+}
+
+/* Whether `p` may succeed without consuming anything */
+static int mpc_re_nullable(mpc_parser_t *p) {
+
+  int j;
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      return 0;
+
+    case MPC_TYPE_STRING: return p->data.string.x[0] == '\0';
+    case MPC_TYPE_EXPECT: return mpc_re_nullable(p->data.expect.x);
+
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return mpc_re_nullable(p->data.repeat.x);
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_re_nullable(p->data.or.xs[j])) { return 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_re_nullable(p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
+
+    default: return 1;
+  }
+
+}
+
+/* Whether `p` never consumes anything */
+static int mpc_re_empty(mpc_parser_t *p) {
+
+  int j;
+
+  switch (p->type) {
+
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_NOT:
+      return 1;
+
+    case MPC_TYPE_EXPECT: return mpc_re_empty(p->data.expect.x);
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_re_empty(p->data.or.xs[j])) { return 0; }
+      }
+      return 1;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_re_empty(p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
+
+    default: return 0;
+  }
+
+}
+
+static void mpc_re_emit_class(mpc_re_prog_t *g, int op, const unsigned char *set) {
+
+  int c, n = 0, last = 0;
+
+  for (c = 1; c < 256; c++) {
+    if (set[c]) { n++; last = c; }
+  }
+
+  if (op == MPC_RE_OP_SET && n == 1) {
+    mpc_re_emit(g, MPC_RE_OP_CHAR, (char)last);
+    return;
+  }
+
+  g->sets = realloc(g->sets, 256 * (g->sets_num + 1));
+  memcpy(g->sets[g->sets_num], set, 256);
+  mpc_re_emit(g, op, g->sets_num++);
+}
+
+/*
+** Append the code for `p`. When `str` is set its
+** result must be a string, and `seq` says it is
+** part of a sequence, which undoes any input a
+** failed `count` leaves consumed.
+*/
+
+static int mpc_re_compile_node(mpc_re_prog_t *g, mpc_parser_t *p, int str, int seq) {
+
+  unsigned char set[256];
+  int j, k, ok;
+  int *commits;
+  const char *s;
+
+  if (p->retained) { return 0; }
+
+  memset(set, 0, sizeof(set));
+  if (mpc_re_class(p, set)) {
+    mpc_re_emit_class(g, MPC_RE_OP_SET, set);
+    return 1;
+  }
+
+  switch (p->type) {
+
+    case MPC_TYPE_EXPECT: return mpc_re_compile_node(g, p->data.expect.x, str, seq);
+
+    case MPC_TYPE_STRING:
+      for (s = p->data.string.x; *s; s++) { mpc_re_emit(g, MPC_RE_OP_CHAR, *s); }
+      return 1;
+
+    case MPC_TYPE_LIFT: return p->data.lift.lf == mpcf_ctor_str;
+
+    case MPC_TYPE_SOI:
+      if (str) { return 0; }
+      mpc_re_emit(g, MPC_RE_OP_SOI, 0);
+      return 1;
+
+    case MPC_TYPE_EOI:
+      if (str) { return 0; }
+      mpc_re_emit(g, MPC_RE_OP_EOI, 0);
+      return 1;
+
+    case MPC_TYPE_ANCHOR:
+      if (str) { return 0; }
+      j = mpc_re_emit(g, MPC_RE_OP_ANCHOR, 0);
+      g->code[j].f = p->data.anchor.f;
+      return 1;
+
+    case MPC_TYPE_NOT:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      j = mpc_re_emit(g, MPC_RE_OP_CHOICE, 0);
+      if (!mpc_re_compile_node(g, p->data.not.x, 0, 0)) { return 0; }
+      mpc_re_emit(g, MPC_RE_OP_FAILTWICE, 0);
+      g->code[j].x = g->code_num;
+      return 1;
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      j = mpc_re_emit(g, MPC_RE_OP_CHOICE, 0);
+      if (!mpc_re_compile_node(g, p->data.not.x, 1, 0)) { return 0; }
+      k = mpc_re_emit(g, MPC_RE_OP_COMMIT, 0);
+      g->code[j].x = g->code_num;
+      g->code[k].x = g->code_num;
+      return 1;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold
+      ||  mpc_re_nullable(p->data.repeat.x)) { return 0; }
+      if (p->type == MPC_TYPE_MANY1
+      && !mpc_re_compile_node(g, p->data.repeat.x, 1, 0)) { return 0; }
+      memset(set, 0, sizeof(set));
+      if (mpc_re_class(p->data.repeat.x, set)) {
+        mpc_re_emit_class(g, MPC_RE_OP_SPAN, set);
+        return 1;
+      }
+      j = mpc_re_emit(g, MPC_RE_OP_CHOICE, 0);
+      if (!mpc_re_compile_node(g, p->data.repeat.x, 1, 0)) { return 0; }
+      mpc_re_emit(g, MPC_RE_OP_COMMIT, j);
+      g->code[j].x = g->code_num;
+      return 1;
+
+    case MPC_TYPE_COUNT:
+      if (!seq || p->data.repeat.f != mpcf_strfold
+      ||  p->data.repeat.n < 1 || p->data.repeat.n > MPC_RE_COUNT_MAX) { return 0; }
+      for (j = 0; j < p->data.repeat.n; j++) {
+        if (!mpc_re_compile_node(g, p->data.repeat.x, 1, 0)) { return 0; }
+      }
+      return 1;
+
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      commits = malloc(sizeof(int) * p->data.or.n);
+      ok = 1;
+      for (j = 0; ok && j < p->data.or.n - 1; j++) {
+        k = mpc_re_emit(g, MPC_RE_OP_CHOICE, 0);
+        ok = mpc_re_compile_node(g, p->data.or.xs[j], str, 0);
+        commits[j] = mpc_re_emit(g, MPC_RE_OP_COMMIT, 0);
+        g->code[k].x = g->code_num;
+      }
+      ok = ok && mpc_re_compile_node(g, p->data.or.xs[j], str, 0);
+      for (k = 0; ok && k < p->data.or.n - 1; k++) { g->code[commits[k]].x = g->code_num; }
+      free(commits);
+      return ok;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { return 0; }
+      if (p->data.and.f == mpcf_strfold) {
+        for (j = 0; j < p->data.and.n; j++) {
+          if (!mpc_re_compile_node(g, p->data.and.xs[j], 1, 1)) { return 0; }
+        }
+        return 1;
+      }
+      if (p->data.and.n == 2 && p->data.and.f == mpcf_fst && mpc_re_empty(p->data.and.xs[1])) {
+        return mpc_re_compile_node(g, p->data.and.xs[0], str, 1)
+            && mpc_re_compile_node(g, p->data.and.xs[1], 0, 1);
+      }
+      if (p->data.and.n == 2 && p->data.and.f == mpcf_snd && mpc_re_empty(p->data.and.xs[0])) {
+        return mpc_re_compile_node(g, p->data.and.xs[0], 0, 1)
+            && mpc_re_compile_node(g, p->data.and.xs[1], str, 1);
+      }
+      return 0;
+
+    default: return 0;
+  }
+
+}
+
+/* Wrap the tree for a regex with its compiled program if it has one */
+static mpc_parser_t *mpc_re_compile(mpc_parser_t *x) {
+
+  mpc_parser_t *p;
+  mpc_re_prog_t *g = calloc(1, sizeof(mpc_re_prog_t));
+
+  if (!mpc_re_compile_node(g, x, 1, 0)) {
+    mpc_re_prog_delete(g);
+    return x;
+  }
+  mpc_re_emit(g, MPC_RE_OP_MATCH, 0);
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_REGEX;
+  p->data.regex.x = x;
+  p->data.regex.g = g;
+  return p;
+}
+
 mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   char *err_msg;
@@ -2417,7 +3193,7 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
-  return r.output;
+  return mpc_re_compile(r.output);
 
 }
 
@@ -2700,6 +3476,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     return;
   }
 
+  if (p->type == MPC_TYPE_REGEX) { mpc_print_unretained(p->data.regex.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)  { mpc_print_unretained(p->data.memo.x, 0); }
+
   if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
   if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
   if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
@@ -2886,18 +3665,36 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 
 void mpc_ast_delete(mpc_ast_t *a) {
 
-  int i;
+  int i, n, slots;
+  mpc_ast_t **stack;
 
   if (a == NULL) { return; }
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  /* Nodes still to free wait on a stack, so deep trees don't recurse */
+  slots = 16;
+  stack = malloc(sizeof(mpc_ast_t*) * slots);
+  stack[0] = a;
+  n = 1;
+
+  while (n > 0) {
+    a = stack[--n];
+    if (a == NULL) { continue; }
+
+    if (n + a->children_num > slots) {
+      while (n + a->children_num > slots) { slots *= 2; }
+      stack = realloc(stack, sizeof(mpc_ast_t*) * slots);
+    }
+    for (i = 0; i < a->children_num; i++) {
+      stack[n++] = a->children[i];
+    }
+
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
   }
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  free(stack);
 
 }
 
@@ -2908,6 +3705,24 @@ static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a);
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *r;
+
+  if (a == NULL) { return NULL; }
+
+  r = mpc_ast_new(a->tag, a->contents);
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  return r;
+
+}
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
@@ -3284,6 +4099,7 @@ mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
 mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
 mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
 mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_copy_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
 
 mpc_parser_t *mpca_or(int n, ...) {
 
@@ -3582,7 +4398,10 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
 
   mpc_optimise(r.output);
 
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  if (st->flags & MPCA_LANG_PREDICTIVE) { r.output = mpc_predictive(r.output); }
+  if (st->flags & MPCA_LANG_PACKRAT) { r.output = mpca_memo(r.output); }
+
+  return r.output;
 
 }
 
@@ -3662,6 +4481,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3867,6 +4687,9 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
 
+  if (p->type == MPC_TYPE_REGEX) { return mpc_nodecount_unretained(p->data.regex.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)  { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+
   if (p->type == MPC_TYPE_OR) {
     total = 1;
     for(i = 0; i < p->data.or.n; i++) {
@@ -3891,6 +4714,11 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (p->type == MPC_TYPE_MEMO) {
+    printf("Memo Lookups: %li\n", p->data.memo.lookups);
+    printf("Memo Hits: %li (%.1f%%)\n", p->data.memo.hits,
+      p->data.memo.lookups ? 100.0 * p->data.memo.hits / p->data.memo.lookups : 0.0);
+  }
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3908,6 +4736,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
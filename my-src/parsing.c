@@ -1,7 +1,22 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "mpc.h"
 #include "lval.h"
+#include "main.h"
+#include "parsing.h"
+
+int lispy_reader = READER_DIRECT;
+
+/* Grammar for the mpc reader, built by main when it is selected */
+mpc_parser_t *Lispy = NULL;
 
 lval *lval_read_num(mpc_ast_t *t) {
     errno = 0;
@@ -25,12 +40,19 @@ lval *lval_read_str(mpc_ast_t *t) {
     return str;
 }
 
-lval *lval_read(mpc_ast_t *t) {
+/* Convert the AST 't' inside 'depth' lists, NULL with 'deep' set to the first list past LREADER_MAX_DEPTH */
+static lval *lval_read_ast(mpc_ast_t *t, int depth, mpc_ast_t **deep) {
     /* If symbol or number return conversion to that type */
     if (strstr(t->tag, "number")) { return lval_read_num(t); }
     if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
     if (strstr(t->tag, "string")) { return lval_read_str(t); }
 
+    /* Lists are read by recursion so refuse them as the direct reader does once too deep */
+    if ((strstr(t->tag, "sexpr") || strstr(t->tag, "qexpr")) && depth++ == LREADER_MAX_DEPTH) {
+        *deep = t;
+        return NULL;
+    }
+
     /* If root (>) or sexpr then create empty list */
     lval *x = NULL;
     if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
@@ -45,7 +67,343 @@ lval *lval_read(mpc_ast_t *t) {
         if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
         if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
         if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));
+        lval *y = lval_read_ast(t->children[i], depth, deep);
+        if (!y) {
+            lval_del(x);
+            return NULL;
+        }
+        x = lval_add(x, y);
+    }
+    return x;
+}
+
+/* Convert the AST of source 'name', or return an error if it nests too deeply */
+lval *lval_read(char *name, mpc_ast_t *t) {
+    mpc_ast_t *deep = NULL;
+    lval *x = lval_read_ast(t, 0, &deep);
+    return x ? x : lval_err("%s:%li:%li: error: nested too deeply", name, deep->state.row + 1, deep->state.col + 1);
+}
+
+/*
+ * Direct reader, builds lvals from source text in a single pass without an
+ * mpc AST. It accepts the same language as the mpc grammar in main.c and
+ * reads it the same way, so "1-2" is still the numbers 1 and -2.
+ */
+
+/* Size of the first buffer for input read from a descriptor */
+#define LREADER_BUFFER 65536
+
+/* Read more input from the descriptor until s[i] is available */
+static int lreader_fill(lreader *r, long i) {
+    while (i >= r->len) {
+        if (r->len == r->capacity) {
+            r->capacity *= 2;
+            r->s = realloc(r->s, r->capacity);
+        }
+        ssize_t n = read(r->fd, r->s + r->len, r->capacity - r->len);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && !r->err) { r->err = lval_err("%s: %s", r->name, strerror(errno)); }
+        if (n <= 0) { return 0; }
+        r->len += n;
+    }
+    return 1;
+}
+
+/* Whether s[i] exists, reading more input if needed */
+static inline int lreader_more(lreader *r, long i) {
+    return i < r->len || (r->fd >= 0 && lreader_fill(r, i));
+}
+
+/* Drop consumed input from the buffer once it fills half of it, only between forms */
+static void lreader_compact(lreader *r) {
+    if (r->fd < 0 || r->pos < r->capacity / 2) { return; }
+
+    for (long i = 0; i < r->pos; i++) {
+        if (r->s[i] == '\n') {
+            r->line++;
+            r->col = 1;
+        } else {
+            r->col++;
+        }
+    }
+    memmove(r->s, r->s + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+}
+
+static void lreader_error(lreader *r, char *msg) {
+    if (r->err) { return; }
+
+    long line = r->line;
+    long col = r->col;
+    for (long i = 0; i < r->pos; i++) {
+        if (r->s[i] == '\n') {
+            line++;
+            col = 1;
+        } else {
+            col++;
+        }
+    }
+    r->err = lval_err("%s:%li:%li: error: %s", r->name, line, col, msg);
+}
+
+/* Skip whitespace and comments */
+static void lreader_space(lreader *r) {
+    while (lreader_more(r, r->pos)) {
+        char c = r->s[r->pos];
+        if (c == ';') {
+            while (lreader_more(r, r->pos) && r->s[r->pos] != '\n' && r->s[r->pos] != '\r') { r->pos++; }
+        } else if (c != '\0' && isspace((unsigned char) c)) {
+            r->pos++;
+        } else {
+            break;
+        }
+    }
+}
+
+static int lreader_symbol_char(char c) {
+    return c != '\0' && (isalnum((unsigned char) c) || strchr("_+-*/\\=<>!&", c));
+}
+
+static int lreader_digit(lreader *r, long i) {
+    return lreader_more(r, i) && r->s[i] >= '0' && r->s[i] <= '9';
+}
+
+/* A number is -?[0-9]+, out of range numbers become an error value as with mpc */
+static lval *lreader_number(lreader *r) {
+    int neg = r->s[r->pos] == '-';
+    if (neg) { r->pos++; }
+
+    long x = 0;
+    int range = 1;
+    for (; lreader_digit(r, r->pos); r->pos++) {
+        int d = r->s[r->pos] - '0';
+        if (neg ? x < (LONG_MIN + d) / 10 : x > (LONG_MAX - d) / 10) { range = 0; }
+        if (range) { x = x * 10 + (neg ? -d : d); }
+    }
+    return range ? lval_num(x) : lval_err("invalid number");
+}
+
+static lval *lreader_symbol(lreader *r) {
+    long start = r->pos;
+    while (lreader_more(r, r->pos) && lreader_symbol_char(r->s[r->pos])) { r->pos++; }
+    return lval_sym_len(r->s + start, r->pos - start);
+}
+
+/* Characters that can follow a backslash in a string and what they stand for */
+static const char lreader_escapes[] = "abfnrtv\\'\"0";
+static const char lreader_unescaped[] = "\a\b\f\n\r\t\v\\'\"";
+
+/* Unescape as mpcf_unescape does, unknown escapes are kept as they are and \0 is dropped */
+static lval *lreader_string(lreader *r) {
+    long start = ++r->pos;
+    while (lreader_more(r, r->pos) && r->s[r->pos] != '"') {
+        r->pos += r->s[r->pos] == '\\' ? 2 : 1;
     }
+    if (!lreader_more(r, r->pos)) {
+        r->pos = r->len;
+        lreader_error(r, "unterminated string");
+        return NULL;
+    }
+
+    /* String values end at a NUL so one can't appear inside the literal */
+    long len = r->pos - start;
+    char *nul = memchr(r->s + start, '\0', len);
+    if (nul) {
+        r->pos = nul - r->s;
+        lreader_error(r, "unexpected byte 0x00 in string");
+        return NULL;
+    }
+
+    /* Copy the slice straight into the value and unescape it in place, it can only shrink */
+    lval *x = lval_str_len(r->s + start, len);
+    char *str = x->str;
+    long n = 0;
+    for (long i = 0; i < len; i++) {
+        char c = str[i];
+        char *esc = c == '\\' ? strchr(lreader_escapes, str[i + 1]) : NULL;
+        if (esc && *esc) {
+            i++;
+            if (*esc == '0') { continue; }
+            c = lreader_unescaped[esc - lreader_escapes];
+        }
+        str[n++] = c;
+    }
+    str[n] = '\0';
+    r->pos++;
     return x;
 }
+
+static lval *lreader_list(lreader *r, char end);
+
+/* Read one value, or NULL on a syntax error */
+static lval *lreader_value(lreader *r) {
+    char c = r->s[r->pos];
+    if (c == '(' || c == '{') {
+        if (r->depth == LREADER_MAX_DEPTH) {
+            lreader_error(r, "nested too deeply");
+            return NULL;
+        }
+        r->pos++;
+        r->depth++;
+        lval *x = lreader_list(r, c == '(' ? ')' : '}');
+        r->depth--;
+        return x;
+    }
+    if (c == '"') { return lreader_string(r); }
+    if ((c == '-' && lreader_digit(r, r->pos + 1)) || lreader_digit(r, r->pos)) {
+        return lreader_number(r);
+    }
+    if (lreader_symbol_char(c)) { return lreader_symbol(r); }
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), isprint((unsigned char) c) ? "unexpected '%c'" : "unexpected byte 0x%02x",
+             (unsigned char) c);
+    lreader_error(r, msg);
+    return NULL;
+}
+
+/* Read values up to the closing 'end', or the end of input when it is '\0' */
+static lval *lreader_list(lreader *r, char end) {
+    lval *x = end == '}' ? lval_qexpr() : lval_sexpr();
+    while (1) {
+        lreader_space(r);
+        if (!lreader_more(r, r->pos)) {
+            if (end == '\0') { return x; }
+            lreader_error(r, end == ')' ? "expected ')'" : "expected '}'");
+            break;
+        }
+        if (end != '\0' && r->s[r->pos] == end) {
+            r->pos++;
+            return x;
+        }
+
+        lval *y = lreader_value(r);
+        if (!y) { break; }
+        x = lval_add(x, y);
+    }
+    lval_del(x);
+    return NULL;
+}
+
+/* Read every form in 's' into an S-expression, or return the first syntax error */
+lval *lval_read_src(char *name, char *s, long len) {
+    lreader r = {name, s, len, 0, NULL, -1, 0, 0, 1, 1, NULL, 0};
+    lval *x = lreader_list(&r, '\0');
+    return x ? x : r.err;
+}
+
+/*
+ * Open a source file for reading a form at a time with the selected reader,
+ * "-" reads standard input. Named regular files are parsed in place from a
+ * read only mapping, anything else is read through a buffer as forms are
+ * asked for. Failing to open the file is reported by the first lreader_next.
+ */
+void lreader_open(lreader *r, char *filename) {
+    *r = (lreader) {filename, NULL, 0, 0, NULL, -1, 0, 0, 1, 1, NULL, 0};
+
+    if (lispy_reader == READER_MPC) {
+        mpc_result_t result;
+        int ok = strcmp(filename, "-") == 0 ? mpc_parse_pipe("<stdin>", stdin, Lispy, &result)
+                                            : mpc_parse_contents(filename, Lispy, &result);
+        if (!ok) {
+            char *error_message = mpc_err_string(result.error);
+            mpc_err_delete(result.error);
+            r->err = lval_err("%s", error_message);
+            free(error_message);
+            return;
+        }
+        r->forms = lval_read(r->name, result.output);
+        mpc_ast_delete(result.output);
+        if (r->forms->type == LVAL_ERR) {
+            r->err = r->forms;
+            r->forms = NULL;
+        }
+        return;
+    }
+
+    int fd = STDIN_FILENO;
+    if (strcmp(filename, "-") == 0) {
+        r->name = "<stdin>";
+    } else {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            r->err = lval_err("%s: %s", filename, strerror(errno));
+            return;
+        }
+    }
+
+    /* Standard input may have been partly read already, so only named files are mapped from the start */
+    struct stat st;
+    if (fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input != MAP_FAILED) {
+            madvise(input, st.st_size, MADV_SEQUENTIAL);
+            r->s = input;
+            r->len = (long) st.st_size;
+            r->mapped = 1;
+            close(fd);
+            return;
+        }
+    }
+
+    r->fd = fd;
+    r->capacity = LREADER_BUFFER;
+    r->s = malloc(r->capacity);
+}
+
+/* Read the next top level form, NULL at the end of input or after an error */
+lval *lreader_next(lreader *r) {
+    if (r->forms) { return r->forms->count ? lval_pop(r->forms, 0) : NULL; }
+
+    if (r->err) {
+        /* Hand out the error once and stop reading */
+        lval *err = r->err;
+        r->err = NULL;
+        if (r->fd > STDIN_FILENO) { close(r->fd); }
+        r->fd = -1;
+        r->pos = r->len;
+        return err;
+    }
+
+    lreader_compact(r);
+    lreader_space(r);
+    if (!lreader_more(r, r->pos)) { return r->err ? lreader_next(r) : NULL; }
+
+    lval *x = lreader_value(r);
+    // a form cut short by a failed read is dropped in favour of the error
+    if (x && r->err) {
+        lval_del(x);
+        x = NULL;
+    }
+    return x ? x : lreader_next(r);
+}
+
+void lreader_close(lreader *r) {
+    if (r->forms) { lval_del(r->forms); }
+    if (r->err) { lval_del(r->err); }
+    if (r->mapped) {
+        munmap(r->s, r->len);
+    } else {
+        free(r->s);
+    }
+    if (r->fd > STDIN_FILENO) { close(r->fd); }
+}
+
+/* Read a line typed at the prompt with the selected reader, 'c' is reused by mpc across lines */
+lval *lval_read_line(mpc_context_t *c, char *input) {
+    if (lispy_reader == READER_MPC) {
+        mpc_result_t r;
+        if (!mpc_context_parse(c, "<stdin>", input, Lispy, &r)) {
+            char *error_message = mpc_err_string(r.error);
+            mpc_err_delete(r.error);
+            lval *err = lval_err("%s", error_message);
+            free(error_message);
+            return err;
+        }
+        lval *x = lval_read("<stdin>", r.output);
+        mpc_ast_delete(r.output);
+        return x;
+    }
+    return lval_read_src("<stdin>", input, (long) strlen(input));
+}
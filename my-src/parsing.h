@@ -4,8 +4,55 @@
 #include "lval.h"
 #include "mpc.h"
 
+/* Which parser source text is read with */
+enum {
+    READER_MPC,
+    READER_DIRECT
+};
+
+extern int lispy_reader;
+
+/* Deepest nesting of lists read, as values are printed, copied and freed recursively */
+#define LREADER_MAX_DEPTH 10000
+
+/* Source of top level forms, read one at a time */
+typedef struct lreader {
+    char *name;
+    char *s;
+    long len;
+    long pos;
+
+    // First syntax or read error, reading stops once it is set
+    lval *err;
+
+    // Descriptor more input is read from into 's', or -1 once it is all in memory
+    int fd;
+    long capacity;
+    int mapped;
+
+    // Line and column of s[0], input before it has been consumed and dropped
+    long line;
+    long col;
+
+    // Forms read up front by mpc
+    lval *forms;
+
+    // Lists open around the current position
+    int depth;
+} lreader;
+
 lval *lval_add(lval *v, lval *x);
 
-lval* lval_read(mpc_ast_t* t);
+lval *lval_read(char *name, mpc_ast_t *t);
+
+lval *lval_read_src(char *name, char *s, long len);
+
+void lreader_open(lreader *r, char *filename);
+
+lval *lreader_next(lreader *r);
+
+void lreader_close(lreader *r);
+
+lval *lval_read_line(mpc_context_t *c, char *input);
 
 #endif
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_ALIGN)
+
+/* Freed blocks are linked through their first word */
+typedef struct slab_block {
+    struct slab_block *next;
+} slab_block;
+
+/* Slabs are chained through a header at their start so they can be released */
+typedef struct slab_header {
+    struct slab_header *next;
+} slab_header;
+
+typedef struct slab_cache {
+    slab_block *free[SLAB_CLASSES];
+    slab_header *slabs;
+    char *bump;
+    char *bump_end;
+    slab_stats stats;
+} slab_cache;
+
+static _Thread_local slab_cache cache;
+
+static void slab_count(long objects, long bytes) {
+    cache.stats.live_objects += objects;
+    cache.stats.live_bytes += bytes;
+    if (cache.stats.live_bytes > cache.stats.high_water_bytes) {
+        cache.stats.high_water_bytes = cache.stats.live_bytes;
+    }
+}
+
+#ifndef LISPY_NO_SLAB
+
+/* Size class index for a request, sizes are rounded up to SLAB_ALIGN */
+static int slab_class(size_t size) {
+    return (int) ((size + SLAB_ALIGN - 1) / SLAB_ALIGN) - 1;
+}
+
+/* Carve a new block of the given class out of the current slab */
+static void *slab_carve(int c) {
+    size_t size = (size_t) (c + 1) * SLAB_ALIGN;
+    if (cache.bump + size > cache.bump_end) {
+        /* Whatever is left of the old slab is abandoned */
+        slab_header *s = malloc(SLAB_SIZE);
+        s->next = cache.slabs;
+        cache.slabs = s;
+        cache.bump = (char *) s + SLAB_ALIGN;
+        cache.bump_end = (char *) s + SLAB_SIZE;
+        cache.stats.slab_bytes += SLAB_SIZE;
+    }
+    void *p = cache.bump;
+    cache.bump += size;
+    return p;
+}
+
+#endif
+
+void *slab_alloc(size_t size) {
+    if (size == 0) { return NULL; }
+#ifdef LISPY_NO_SLAB
+    slab_count(1, (long) size);
+    return malloc(size);
+#else
+    if (size > SLAB_MAX_SIZE) {
+        slab_count(1, (long) size);
+        return malloc(size);
+    }
+
+    int c = slab_class(size);
+    slab_count(1, (long) (c + 1) * SLAB_ALIGN);
+    slab_block *b = cache.free[c];
+    if (b) {
+        cache.free[c] = b->next;
+        return b;
+    }
+    return slab_carve(c);
+#endif
+}
+
+void slab_free(void *p, size_t size) {
+    if (!p) { return; }
+#ifdef LISPY_NO_SLAB
+    slab_count(-1, -(long) size);
+    free(p);
+#else
+    if (size > SLAB_MAX_SIZE) {
+        slab_count(-1, -(long) size);
+        free(p);
+        return;
+    }
+
+    int c = slab_class(size);
+    slab_count(-1, -(long) (c + 1) * SLAB_ALIGN);
+    slab_block *b = p;
+    b->next = cache.free[c];
+    cache.free[c] = b;
+#endif
+}
+
+void *slab_realloc(void *p, size_t old_size, size_t new_size) {
+    if (!p) { return slab_alloc(new_size); }
+    if (new_size == 0) {
+        slab_free(p, old_size);
+        return NULL;
+    }
+#ifndef LISPY_NO_SLAB
+    if (old_size <= SLAB_MAX_SIZE || new_size <= SLAB_MAX_SIZE) {
+        /* Nothing to do if both sizes land in the same class */
+        if (old_size <= SLAB_MAX_SIZE && new_size <= SLAB_MAX_SIZE
+            && slab_class(old_size) == slab_class(new_size)) {
+            return p;
+        }
+        void *n = slab_alloc(new_size);
+        memcpy(n, p, old_size < new_size ? old_size : new_size);
+        slab_free(p, old_size);
+        return n;
+    }
+#endif
+    /* Both sizes are outside the slabs so let malloc resize in place if it can */
+    slab_count(0, (long) new_size - (long) old_size);
+    return realloc(p, new_size);
+}
+
+slab_stats slab_get_stats() {
+    return cache.stats;
+}
+
+void slab_cleanup() {
+    while (cache.slabs) {
+        slab_header *s = cache.slabs;
+        cache.slabs = s->next;
+        free(s);
+    }
+    memset(&cache, 0, sizeof(slab_cache));
+}
@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Size class allocator for lval cells and small cell arrays.
+ *
+ * Requests up to SLAB_MAX_SIZE bytes are rounded up to a multiple of
+ * SLAB_ALIGN and served from per size class free lists, carved out of large
+ * slabs. Bigger requests fall through to malloc. Every thread has its own
+ * slabs and free lists so there is no locking, memory must be freed by the
+ * thread that allocated it. Callers pass the size they asked for when freeing.
+ *
+ * Building with LISPY_NO_SLAB sends everything to malloc, which is useful when
+ * running under a memory checker. The statistics are kept either way.
+ */
+
+#define SLAB_ALIGN 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_SIZE (64 * 1024)
+
+typedef struct slab_stats {
+    long live_objects;
+    long live_bytes;
+    long high_water_bytes;
+    long slab_bytes;
+} slab_stats;
+
+void *slab_alloc(size_t size);
+
+void *slab_realloc(void *p, size_t old_size, size_t new_size);
+
+void slab_free(void *p, size_t size);
+
+slab_stats slab_get_stats();
+
+void slab_cleanup();
+
+#endif
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "lenv.h"
+#include "gc.h"
+
+static lval *sym(int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "s%d", i);
+    return lval_sym(name);
+}
+
+static void put(lenv *e, int i) {
+    lval *k = sym(i);
+    lval *v = lval_num(i);
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+static int remove_sym(lenv *e, int i) {
+    lval *k = sym(i);
+    int removed = lenv_remove(e, k);
+    lval_del(k);
+    return removed;
+}
+
+/* Every binding is found at its own position and the order matches 'expect' */
+static void check(lenv *e, int *expect, int count) {
+    assert(e->count == count);
+    for (int i = 0; i < count; i++) {
+        lval *k = sym(expect[i]);
+        assert(e->syms[i] == k->sym);
+        assert(e->vals[i]->type == LVAL_NUM && e->vals[i]->num == expect[i]);
+        assert(lenv_find(e, k->sym) == i);
+        lval *v = lenv_get(e, k);
+        assert(v->type == LVAL_NUM && v->num == expect[i]);
+        lval_del(v);
+        lval_del(k);
+    }
+}
+
+/* Remove a middle binding from an environment of n bindings, then add it back */
+static void remove_middle(int n) {
+    int expect[1000];
+    lenv *e = lenv_new();
+    for (int i = 0; i < n; i++) {
+        put(e, i);
+        expect[i] = i;
+    }
+
+    int mid = n / 2;
+    assert(remove_sym(e, mid));
+    assert(!remove_sym(e, mid));
+    for (int i = mid; i + 1 < n; i++) { expect[i] = expect[i + 1]; }
+    check(e, expect, n - 1);
+
+    lval *k = sym(mid);
+    lval *v = lenv_get(e, k);
+    assert(v->type == LVAL_ERR);
+    lval_del(v);
+    lval_del(k);
+
+    /* A binding put back goes at the end */
+    put(e, mid);
+    expect[n - 1] = mid;
+    check(e, expect, n);
+
+    lenv_del(e);
+}
+
+/* Remove every third binding so later removals probe past earlier holes */
+static void remove_many(int n) {
+    int expect[1000];
+    int count = 0;
+    lenv *e = lenv_new();
+    for (int i = 0; i < n; i++) { put(e, i); }
+    for (int i = 0; i < n; i += 3) { assert(remove_sym(e, i)); }
+    for (int i = 0; i < n; i++) {
+        if (i % 3) { expect[count++] = i; }
+    }
+    check(e, expect, count);
+    lenv_del(e);
+}
+
+int main(int argc, char **argv) {
+#ifdef LISPY_GC
+    gc_init(__builtin_frame_address(0));
+#endif
+
+    remove_middle(LENV_INDEX_MIN - 1);
+    remove_middle(LENV_INDEX_MIN * 2);
+    remove_middle(1000);
+    remove_many(1000);
+
+    puts("lenv ok");
+    return 0;
+}
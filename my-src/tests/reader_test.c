@@ -0,0 +1,72 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parsing.h"
+#include "gc.h"
+
+/* Read 'depth' nested S-expressions around a number, closed or not */
+static lval *read_nested(long depth, int closed) {
+    long len = depth * 2 + 1;
+    char *s = malloc(len);
+    memset(s, '(', depth);
+    s[depth] = '1';
+    memset(s + depth + 1, closed ? ')' : ' ', depth);
+    lval *x = lval_read_src("nested", s, len);
+    free(s);
+    return x;
+}
+
+static void nesting() {
+    lval *x = read_nested(LREADER_MAX_DEPTH, 1);
+    assert(x->type == LVAL_SEXPR && x->count == 1);
+    lval_del(x);
+
+    x = read_nested(LREADER_MAX_DEPTH + 1, 1);
+    assert(x->type == LVAL_ERR && strstr(x->err, "nested too deeply"));
+    lval_del(x);
+
+    /* Far too deep to read by recursing, and never closed */
+    x = read_nested(1000000, 0);
+    assert(x->type == LVAL_ERR && strstr(x->err, "nested too deeply"));
+    lval_del(x);
+}
+
+/* Read 'len' bytes holding one string literal */
+static lval *read_string(char *s, long len) {
+    lval *x = lval_read_src("string", s, len);
+    if (x->type == LVAL_ERR) { return x; }
+    assert(x->count == 1 && x->cell[0]->type == LVAL_STR);
+    return lval_take(x, 0);
+}
+
+static void strings() {
+    char escaped[] = "\"a\\tb\\\"c\\0d\\qe\"";
+    lval *x = read_string(escaped, sizeof(escaped) - 1);
+    assert(strcmp(x->str, "a\tb\"cd\\qe") == 0);
+    lval_del(x);
+
+    /* A NUL inside the literal is an error rather than the end of the string */
+    char nul[] = "\"ab\0cd\"";
+    x = read_string(nul, sizeof(nul) - 1);
+    assert(x->type == LVAL_ERR && strstr(x->err, "string:1:4: error: unexpected byte 0x00 in string"));
+    lval_del(x);
+
+    char escaped_nul[] = "\"ab\\\0cd\"";
+    x = read_string(escaped_nul, sizeof(escaped_nul) - 1);
+    assert(x->type == LVAL_ERR && strstr(x->err, "unexpected byte 0x00 in string"));
+    lval_del(x);
+}
+
+int main(int argc, char **argv) {
+#ifdef LISPY_GC
+    gc_init(__builtin_frame_address(0));
+#endif
+
+    nesting();
+    strings();
+
+    puts("reader ok");
+    return 0;
+}
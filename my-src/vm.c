@@ -0,0 +1,326 @@
+#include <stdlib.h>
+
+#include "vm.h"
+#include "lenv.h"
+#include "gc.h"
+
+int lispy_engine = ENGINE_VM;
+
+/* Value stack shared by every active vm_run, each one works above where it started */
+static lval **stack = NULL;
+static int stack_count = 0;
+static int stack_capacity = 0;
+
+static int vm_emit(lcode *c, int op) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+    }
+    c->ops[c->count] = op;
+    return c->count++;
+}
+
+static int vm_constant(lcode *c, lval *v) {
+    if (c->consts_count == c->consts_capacity) {
+        c->consts_capacity = c->consts_capacity ? c->consts_capacity * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval *) * c->consts_capacity);
+    }
+    c->consts[c->consts_count] = v;
+    return c->consts_count++;
+}
+
+/* Slot a symbol is bound at in frames of the function, or -1 if it isn't a formal */
+static int vm_local(lcode *c, lsym *sym) {
+    for (int i = 0; i < c->locals_count; i++) {
+        if (c->locals[i] == sym) { return i; }
+    }
+    return -1;
+}
+
+static void vm_compile_sym(lcode *c, lval *v) {
+    int k = vm_constant(c, v);
+
+    int slot = vm_local(c, v->sym);
+    if (slot >= 0) {
+        vm_emit(c, OP_LOCAL);
+        vm_emit(c, slot);
+        vm_emit(c, k);
+        return;
+    }
+
+    for (int depth = 1; depth <= c->outer_count; depth++) {
+        slot = vm_local(c->outer[depth - 1], v->sym);
+        if (slot >= 0) {
+            vm_emit(c, OP_OUTER);
+            vm_emit(c, depth);
+            vm_emit(c, slot);
+            vm_emit(c, k);
+            return;
+        }
+    }
+
+    if (c->global) {
+        vm_emit(c, OP_GLOBAL);
+        vm_emit(c, -1);
+    } else {
+        vm_emit(c, OP_LOAD);
+    }
+    vm_emit(c, k);
+}
+
+static void vm_compile_expr(lcode *c, lval *v, int tail);
+
+/* Whether an S-expression is an 'if' with literal branches that can be compiled inline */
+static int vm_is_if(lval *v) {
+    return v->count == 4
+           && v->cell[0]->type == LVAL_SYM && v->cell[0]->sym == lsym_if
+           && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR;
+}
+
+/* Compile the elements of 'v' as an S-expression, 'v' may be a Q-expression branch or body */
+static void vm_compile_sexpr(lcode *c, lval *v, int tail) {
+
+    /* Empty and single expressions behave as in lval_eval */
+    if (v->count == 0) {
+        vm_emit(c, OP_EMPTY);
+        return;
+    }
+    if (v->count == 1) {
+        vm_compile_expr(c, v->cell[0], tail);
+        return;
+    }
+
+    if (vm_is_if(v)) {
+        /* Load 'if' and the condition then take the branch directly */
+        vm_compile_expr(c, v->cell[0], 0);
+        vm_compile_expr(c, v->cell[1], 0);
+        int test = vm_emit(c, OP_IF);
+        vm_emit(c, 0);
+        vm_emit(c, 0);
+
+        vm_compile_sexpr(c, v->cell[2], tail);
+        vm_emit(c, OP_JUMP);
+        int then_end = vm_emit(c, 0);
+
+        c->ops[test + 1] = c->count;
+        vm_compile_sexpr(c, v->cell[3], tail);
+        vm_emit(c, OP_JUMP);
+        int else_end = vm_emit(c, 0);
+
+        /* If 'if' has been rebound or the condition isn't a number make a normal call */
+        c->ops[test + 2] = c->count;
+        vm_emit(c, OP_CONST);
+        vm_emit(c, vm_constant(c, v->cell[2]));
+        vm_emit(c, OP_CONST);
+        vm_emit(c, vm_constant(c, v->cell[3]));
+        vm_emit(c, tail ? OP_TAIL : OP_CALL);
+        vm_emit(c, 3);
+
+        c->ops[then_end] = c->count;
+        c->ops[else_end] = c->count;
+        return;
+    }
+
+    /* Otherwise evaluate every element and call the first */
+    for (int i = 0; i < v->count; i++) {
+        vm_compile_expr(c, v->cell[i], 0);
+    }
+    vm_emit(c, tail ? OP_TAIL : OP_CALL);
+    vm_emit(c, v->count - 1);
+}
+
+static void vm_compile_expr(lcode *c, lval *v, int tail) {
+    switch (v->type) {
+        case LVAL_SYM:
+            vm_compile_sym(c, v);
+            break;
+        case LVAL_SEXPR:
+            vm_compile_sexpr(c, v, tail);
+            break;
+        default:
+            /* Everything else evaluates to itself */
+            vm_emit(c, OP_CONST);
+            vm_emit(c, vm_constant(c, v));
+            break;
+    }
+}
+
+lcode *vm_compile(lenv *e, lval *formals, lval *body) {
+    lcode *c = calloc(1, sizeof(lcode));
+    c->refs = 1;
+    c->body = lval_copy(body);
+
+    /* Formals are bound in order, skipping '&' and repeated names */
+    c->locals = malloc(sizeof(lsym *) * formals->count);
+    for (int i = 0; i < formals->count; i++) {
+        lsym *sym = formals->cell[i]->sym;
+        if (sym != lsym_amp && vm_local(c, sym) < 0) {
+            c->locals[c->locals_count++] = sym;
+        }
+    }
+
+    /* Enclosing frames up to the global environment, or the first one that isn't compiled */
+    lenv *p = e;
+    for (; p->parent && p->code; p = p->parent) {
+        c->outer = realloc(c->outer, sizeof(lcode *) * (c->outer_count + 1));
+        c->outer[c->outer_count++] = p->code;
+        p->code->refs++;
+    }
+    c->global = p->parent ? NULL : p;
+
+    vm_compile_sexpr(c, body, 1);
+    vm_emit(c, OP_RETURN);
+    return c;
+}
+
+void lcode_del(lcode *c) {
+    if (--c->refs > 0) { return; }
+    for (int i = 0; i < c->outer_count; i++) { lcode_del(c->outer[i]); }
+    lval_del(c->body);
+    free(c->locals);
+    free(c->outer);
+    free(c->ops);
+    free(c->consts);
+    free(c);
+}
+
+static void vm_push(lval *v) {
+    if (stack_count == stack_capacity) {
+#ifdef LISPY_GC
+        if (!stack) { gc_root_cells(&stack, &stack_count); }
+#endif
+        stack_capacity = stack_capacity ? stack_capacity * 2 : 256;
+        stack = realloc(stack, sizeof(lval *) * stack_capacity);
+    }
+    stack[stack_count++] = v;
+}
+
+/* Pop the top n values into a new S-expression */
+static lval *vm_pop_list(int n) {
+    lval *x = lval_sexpr();
+    for (int i = stack_count - n; i < stack_count; i++) {
+        x = lval_add(x, stack[i]);
+    }
+    stack_count -= n;
+    return x;
+}
+
+/* Result of calling the top three values if they are a builtin with a fast
+ * path for two arguments, otherwise NULL and the stack is untouched */
+static lval *vm_call2(lenv *e) {
+    lval *f = stack[stack_count - 3];
+    if (f->type != LVAL_FUN || !f->builtin) { return NULL; }
+
+    lval *x = builtin_call2(e, f, stack[stack_count - 2], stack[stack_count - 1]);
+    if (x) { stack_count -= 3; }
+    return x;
+}
+
+/* The frame 'depth' parents above frame 'e' of 'c', if every frame on the way
+ * belongs to the function it did when 'c' was compiled and holds only formals */
+static lenv *vm_outer(lcode *c, lenv *e, int depth) {
+    lcode *code = c;
+    for (int d = 0; d < depth; d++) {
+        if (e->code != code || e->count != code->locals_count || !e->parent) { return NULL; }
+        e = e->parent;
+        code = c->outer[d];
+    }
+    return e->code == code ? e : NULL;
+}
+
+/* Run compiled body 'c' in frame 'e'. Returns the result, or if the body ends
+ * in a call sets *tail and returns the evaluated S-expression still to be called. */
+lval *vm_run(lcode *c, lenv *e, int *tail) {
+    int *ops = c->ops;
+    int pc = 0;
+
+    *tail = 0;
+    while (1) {
+        switch (ops[pc++]) {
+            case OP_CONST:
+                vm_push(lval_copy(c->consts[ops[pc++]]));
+                break;
+            case OP_EMPTY:
+                vm_push(lval_sexpr());
+                break;
+            case OP_LOAD:
+                vm_push(lenv_get(e, c->consts[ops[pc++]]));
+                break;
+            case OP_LOCAL: {
+                int slot = ops[pc++];
+                lval *k = c->consts[ops[pc++]];
+                if (slot < e->count && e->syms[slot] == k->sym) {
+                    vm_push(lval_copy(e->vals[slot]));
+                } else {
+                    vm_push(lenv_get(e, k));
+                }
+                break;
+            }
+            case OP_OUTER: {
+                lenv *p = vm_outer(c, e, ops[pc++]);
+                int slot = ops[pc++];
+                lval *k = c->consts[ops[pc++]];
+                if (p && slot < p->count && p->syms[slot] == k->sym) {
+                    vm_push(lval_copy(p->vals[slot]));
+                } else {
+                    vm_push(lenv_get(e, k));
+                }
+                break;
+            }
+            case OP_GLOBAL: {
+                int *slot = &ops[pc++];
+                lval *k = c->consts[ops[pc++]];
+                lenv *g = c->global;
+                /* Only a symbol that has never been bound locally can't be shadowed */
+                if (!k->sym->local && (*slot < 0 || *slot >= g->count || g->syms[*slot] != k->sym)) {
+                    *slot = lenv_find(g, k->sym);
+                }
+                if (!k->sym->local && *slot >= 0) {
+                    vm_push(lval_copy(g->vals[*slot]));
+                } else {
+                    vm_push(lenv_get(e, k));
+                }
+                break;
+            }
+            case OP_CALL: {
+                int n = ops[pc++];
+                lval *x = n == 2 ? vm_call2(e) : NULL;
+                vm_push(x ? x : lval_apply(e, vm_pop_list(n + 1)));
+                break;
+            }
+            case OP_TAIL: {
+                int n = ops[pc];
+                lval *x = n == 2 ? vm_call2(e) : NULL;
+                if (x) { return x; }
+                *tail = 1;
+                return vm_pop_list(n + 1);
+            }
+            case OP_IF: {
+                lval *fn = stack[stack_count - 2];
+                lval *cond = stack[stack_count - 1];
+                if (fn->type == LVAL_FUN && fn->builtin == builtin_if && cond->type == LVAL_NUM) {
+                    int branch = cond->num != 0;
+                    lval_del(fn);
+                    lval_del(cond);
+                    stack_count -= 2;
+                    pc = branch ? pc + 2 : ops[pc];
+                } else {
+                    pc = ops[pc + 1];
+                }
+                break;
+            }
+            case OP_JUMP:
+                pc = ops[pc];
+                break;
+            case OP_RETURN:
+                return stack[--stack_count];
+        }
+    }
+}
+
+void vm_cleanup() {
+    free(stack);
+    stack = NULL;
+    stack_count = 0;
+    stack_capacity = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef VM_H
+#define VM_H
+
+#include "lval.h"
+
+/*
+ * Bytecode compiler and stack machine for lambda bodies.
+ *
+ * A body is compiled when the lambda is created and shared between every copy
+ * of the function and the frames it is called in. Constants are borrowed from
+ * the body, which the code keeps alive.
+ *
+ * Symbols are resolved against the frames the lambda is created in. Formals
+ * of the function and of the enclosing functions become (depth, index) slots
+ * and anything found in none of them a cached slot in the global environment.
+ * Each access checks the frames it passes still belong to the expected
+ * functions and hold nothing but their formals, and falls back to lenv_get
+ * when they don't. Calls in tail position are handed back to lval_eval so tail
+ * recursion runs in constant stack, and the tree walker is still used for
+ * everything outside of lambda bodies such as 'eval' of runtime data.
+ */
+
+enum {
+    ENGINE_TREE,
+    ENGINE_VM
+};
+
+extern int lispy_engine;
+
+enum {
+    OP_CONST,   // k: push constant k
+    OP_EMPTY,   // push an empty S-expression
+    OP_LOAD,    // k: push the value of symbol constant k
+    OP_LOCAL,   // i k: push formal slot i, falling back to looking up symbol constant k
+    OP_OUTER,   // d i k: push slot i of the frame d parents up, falling back as OP_LOCAL
+    OP_GLOBAL,  // i k: push global slot i, resolving and caching i when it doesn't hold k
+    OP_CALL,    // n: call the function below the top n values with them as arguments
+    OP_TAIL,    // n: as OP_CALL but hand the call back to the caller of vm_run
+    OP_IF,      // a b: if the top two values are 'if' and a number pop them and jump to a
+                // when the number is 0, otherwise leave them and jump to b
+    OP_JUMP,    // a: continue at a
+    OP_RETURN   // return the top value
+};
+
+struct lcode {
+    int refs;
+
+    // Body the constants are borrowed from
+    lval *body;
+
+    // Formal symbols in the order they are bound into the function's frame
+    int locals_count;
+    lsym **locals;
+
+    // Functions of the frames the lambda was created in, innermost first
+    int outer_count;
+    lcode **outer;
+
+    // Environment globals are resolved in, NULL if the enclosing frames aren't all compiled
+    lenv *global;
+
+    int count;
+    int capacity;
+    int *ops;
+
+    int consts_count;
+    int consts_capacity;
+    lval **consts;
+};
+
+lcode *vm_compile(lenv *e, lval *formals, lval *body);
+
+void lcode_del(lcode *c);
+
+lval *vm_run(lcode *c, lenv *e, int *tail);
+
+void vm_cleanup();
+
+#endif